@@ -63,60 +63,113 @@ fn checkSystemLibrary(b: *std.Build, name: []const u8) bool {
 }
 
 
-pub fn build(b: *std.Build) void {
-    const target = b.standardTargetOptions(.{});
-    const optimize = b.standardOptimizeOption(.{});
-    const cflags = if (optimize == .Debug)
-        &[_][]const u8{ "-g" }
-    else
-        &[_][]const u8{ "-O2" };
+/// Returns `true` if `path` exists, printing the result like
+/// `checkSystemLibrary()`. Used for cross builds, where the libraries
+/// must be looked up in the sysroot instead of in the host.
+fn checkFile(what: []const u8, path: []const u8) bool {
+    std.debug.print("Checking for '{s}' in '{s}'... ", .{ what, path });
+    const found = if (std.fs.cwd().access(path, .{})) true else |_| false;
+    std.debug.print("{s}\n", .{ if (found) "found" else "not found" });
+    return found;
+}
 
-    if (checkSystemLibrary(b, "libethercat")) {
-        const igh = b.addExecutable(.{
-            .name = "ethercatest-igh",
-            .root_module = b.createModule(.{
-                .target = target,
-                .optimize = optimize,
-                .link_libc = true,
-            }),
-        });
-        igh.addCSourceFiles(.{
-            .files = &[_][]const u8{
-                "src/ethercatest-igh.c",
-                "src/ethercatest.c",
-            },
-            .flags = cflags,
+
+/// How to build and where to install the programs for a given target
+const Config = struct {
+    target: std.Build.ResolvedTarget,
+    optimize: std.builtin.OptimizeMode,
+    cflags: []const []const u8,
+    /// Cross builds cannot use the host `pkg-config`
+    cross: bool,
+    /// Link name of the IgH library, or `null` to not build its test
+    igh: ?[]const u8,
+    soem: bool,
+    include_paths: []const []const u8,
+    library_paths: []const []const u8,
+    step: *std.Build.Step,
+    dest_dir: std.Build.Step.InstallArtifact.Dir,
+};
+
+fn linkLibraries(exe: *std.Build.Step.Compile, config: Config, libs: []const []const u8) void {
+    for (config.library_paths) |path| {
+        exe.addLibraryPath(.{ .cwd_relative = path });
+    }
+    for (libs) |lib| {
+        exe.root_module.linkSystemLibrary(lib, .{
+            .use_pkg_config = if (config.cross) .no else .yes,
         });
-        igh.linkSystemLibrary("libethercat");
-        b.installArtifact(igh);
     }
+}
 
-    if (checkSystemLibrary(b, "soem")) {
-        const soem = b.addExecutable(.{
-            .name = "ethercatest-soem",
-            .root_module = b.createModule(.{
-                .target = target,
-                .optimize = optimize,
-                .link_libc = true,
-            }),
-        });
-        soem.addCSourceFiles(.{
-            .files = &[_][]const u8{
-                "src/ethercatest-soem.c",
-                "src/ethercatest.c",
-            },
-            .flags = cflags,
-        });
-        soem.linkSystemLibrary("soem");
-        b.installArtifact(soem);
+fn install(b: *std.Build, config: Config, exe: *std.Build.Step.Compile) void {
+    const artifact = b.addInstallArtifact(exe, .{ .dest_dir = config.dest_dir });
+    config.step.dependOn(&artifact.step);
+}
+
+fn addProgram(b: *std.Build, config: Config, name: []const u8,
+              files: []const []const u8, libs: []const []const u8) *std.Build.Step.Compile {
+    const exe = b.addExecutable(.{
+        .name = name,
+        .root_module = b.createModule(.{
+            .target = config.target,
+            .optimize = config.optimize,
+            .link_libc = true,
+        }),
+    });
+    exe.addCSourceFiles(.{
+        .files = files,
+        .flags = config.cflags,
+    });
+    for (config.include_paths) |path| {
+        exe.addIncludePath(.{ .cwd_relative = path });
     }
+    linkLibraries(exe, config, libs);
+    install(b, config, exe);
+    return exe;
+}
+
+/// Adds all the programs that can be built with `config` and returns
+/// the test programs, i.e. the ones accepting the shared options.
+fn addPrograms(b: *std.Build, config: Config) [3]?*std.Build.Step.Compile {
+    var tests = [3]?*std.Build.Step.Compile{ null, null, null };
+
+    if (config.igh) |igh| {
+        tests[0] = addProgram(b, config, "ethercatest-igh", &[_][]const u8{
+            "src/ethercatest-igh.c",
+            "src/ethercatest.c",
+        }, &[_][]const u8{ igh, "pthread", "rt" });
+    }
+
+    if (config.soem) {
+        tests[1] = addProgram(b, config, "ethercatest-soem", &[_][]const u8{
+            "src/ethercatest-soem.c",
+            "src/ethercatest.c",
+        }, &[_][]const u8{ "soem", "pthread", "rt" });
+    }
+
+    // The interference generator does not depend on any stack
+    _ = addProgram(b, config, "ethercatest-load", &[_][]const u8{
+        "src/ethercatest-load.c",
+        "src/ethercatest.c",
+    }, &[_][]const u8{ "pthread", "rt" });
+
+    // Live viewer of the metrics published with `--publish`
+    _ = addProgram(b, config, "ethercatest-top", &[_][]const u8{
+        "src/ethercatest-top.c",
+        "src/ethercatest.c",
+    }, &[_][]const u8{ "pthread", "rt" });
+
+    // Responder replaying the sessions saved with `--capture`
+    _ = addProgram(b, config, "ethercatest-replay", &[_][]const u8{
+        "src/ethercatest-replay.c",
+        "src/ethercatest.c",
+    }, &[_][]const u8{ "pthread", "rt" });
 
-    std.debug.print("'gatorcat' is always included\n", .{});
     const gatorcat = b.addExecutable(.{
         .name = "ethercatest-gatorcat",
         .root_module = b.createModule(.{
-            .target = target,
-            .optimize = optimize,
+            .target = config.target,
+            .optimize = config.optimize,
             .root_source_file = b.path("src/ethercatest-gatorcat.zig"),
             .link_libc = true,
         }),
@@ -124,12 +177,118 @@ pub fn build(b: *std.Build) void {
     gatorcat.addIncludePath(b.path("src"));
     gatorcat.addCSourceFile(.{
         .file = b.path("src/ethercatest.c"),
-        .flags = cflags,
+        .flags = config.cflags,
     });
     const gatorcat_dep = b.dependency("gatorcat", .{
+        .target = config.target,
+        .optimize = config.optimize,
+    });
+    gatorcat.root_module.addImport("gatorcat", gatorcat_dep.module("gatorcat"));
+    linkLibraries(gatorcat, config, &[_][]const u8{ "pthread", "rt" });
+    install(b, config, gatorcat);
+    tests[2] = gatorcat;
+
+    return tests;
+}
+
+
+pub fn build(b: *std.Build) void {
+    const target = b.standardTargetOptions(.{});
+    const optimize = b.standardOptimizeOption(.{});
+    const cflags = if (optimize == .Debug)
+        &[_][]const u8{ "-g" }
+    else
+        &[_][]const u8{ "-O2" };
+
+    const igh = checkSystemLibrary(b, "libethercat");
+    const soem = checkSystemLibrary(b, "soem");
+    std.debug.print("'gatorcat' is always included\n", .{});
+    _ = addPrograms(b, .{
         .target = target,
         .optimize = optimize,
+        .cflags = cflags,
+        .cross = false,
+        .igh = if (igh) "libethercat" else null,
+        .soem = soem,
+        .include_paths = &[_][]const u8{},
+        .library_paths = &[_][]const u8{},
+        .step = b.getInstallStep(),
+        .dest_dir = .default,
     });
-    gatorcat.root_module.addImport("gatorcat", gatorcat_dep.module("gatorcat"));
-    b.installArtifact(gatorcat);
+
+    // Beckhoff CX9020 (and any other ARMv7 hard float Linux box):
+    // `zig build cx9020` installs in `zig-out/cx9020/bin` everything
+    // that can be built with the libraries found in the sysroot.
+    // The IgH library is taken from its build tree, as the CX9020
+    // kernel module must be built against the target kernel anyway.
+    const sysroot = b.option([]const u8, "cx9020-sysroot",
+        "Sysroot of the CX9020 cross build (default /usr/arm-linux-gnueabihf)") orelse
+        "/usr/arm-linux-gnueabihf";
+    const ethercat = b.option([]const u8, "cx9020-ethercat",
+        "IgH EtherCAT build tree for the CX9020 cross build");
+    const qemu = b.option([]const u8, "cx9020-qemu",
+        "qemu-user binary for the CX9020 smoke run (default qemu-arm)") orelse
+        "qemu-arm";
+
+    const cx9020 = b.step("cx9020", "Cross build for the CX9020 (armv7-linux-gnueabihf)");
+    const smoke = b.step("cx9020-smoke", "Run the CX9020 platform checks under qemu-user");
+
+    const cross_target = b.resolveTargetQuery(.{
+        .cpu_arch = .arm,
+        .cpu_model = .{ .explicit = &std.Target.arm.cpu.cortex_a8 },
+        .os_tag = .linux,
+        .abi = .gnueabihf,
+    });
+    // The IgH ioctl structures must have the same layout used by the
+    // kernel, so large file support must stay off on 32 bit targets
+    const cross_cflags = if (optimize == .Debug)
+        &[_][]const u8{ "-g", "-U_FILE_OFFSET_BITS" }
+    else
+        &[_][]const u8{ "-O2", "-U_FILE_OFFSET_BITS" };
+
+    const cross_igh = if (ethercat) |path|
+        checkFile("libethercat", b.pathJoin(&.{ path, "lib", ".libs", "libethercat.so" }))
+    else
+        false;
+    const cross_soem =
+        checkFile("soem", b.pathJoin(&.{ sysroot, "lib", "libsoem.a" })) or
+        checkFile("soem", b.pathJoin(&.{ sysroot, "lib", "libsoem.so" }));
+
+    var cross_include: std.ArrayList([]const u8) = .empty;
+    var cross_lib: std.ArrayList([]const u8) = .empty;
+    cross_include.append(b.allocator, b.pathJoin(&.{ sysroot, "include" })) catch @panic("OOM");
+    cross_lib.append(b.allocator, b.pathJoin(&.{ sysroot, "lib" })) catch @panic("OOM");
+    if (cross_igh) {
+        cross_include.append(b.allocator, b.pathJoin(&.{ ethercat.?, "include" })) catch @panic("OOM");
+        cross_lib.append(b.allocator, b.pathJoin(&.{ ethercat.?, "lib", ".libs" })) catch @panic("OOM");
+    }
+
+    const tests = addPrograms(b, .{
+        .target = cross_target,
+        .optimize = optimize,
+        .cflags = cross_cflags,
+        .cross = true,
+        .igh = if (cross_igh) "ethercat" else null,
+        .soem = cross_soem,
+        .include_paths = cross_include.items,
+        .library_paths = cross_lib.items,
+        .step = cx9020,
+        .dest_dir = .{ .override = .{ .custom = "cx9020/bin" } },
+    });
+
+    // The platform checks do not need any bus, so every test program
+    // can run them under emulation. Only the functionality is checked:
+    // the timings measured by qemu-user say nothing about the CX9020.
+    for (tests) |maybe_exe| {
+        const exe = maybe_exe orelse continue;
+        const run = b.addSystemCommand(&.{ qemu, "-L", sysroot });
+        if (cross_igh) {
+            run.setEnvironmentVariable("LD_LIBRARY_PATH",
+                b.pathJoin(&.{ ethercat.?, "lib", ".libs" }));
+        }
+        run.addArtifactArg(exe);
+        run.addArg("--platform");
+        run.expectExitCode(0);
+        smoke.dependOn(&run.step);
+    }
 }
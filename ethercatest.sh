@@ -1,7 +1,49 @@
 #!/bin/bash
 # Usage:
-#   ethercatest.sh STACK [PERIOD]
-# where STACK can be soem, gatorcat or igh.
+#   ethercatest.sh [-o DATASET] [-l LABEL] [-i IFACE[,IFACE...]]
+#                  [-I INTERFERENCES] [-f FLOOD_IFACE] [-P CPUS] [-S SDO]
+#                  [-B BREAK] [-a]
+#                  STACK [PERIOD] [NIC_PROFILE]
+# where STACK can be soem, gatorcat or igh and NIC_PROFILE is one of the
+# profiles accepted by `--nic-profile` (see `ethercatest-soem --help`).
+#
+# The tests are repeated under every interference in the comma separated
+# INTERFERENCES list (default: idle,cpu,memory,cache,io), generated by
+# `ethercatest-load`:
+#
+# - idle:   no interference
+# - cpu:    256 busy loops
+# - memory: one memory bandwidth hog per CPU
+# - cache:  one cache thrashing hog per CPU
+# - io:     4 workers doing synchronous writes
+# - net:    broadcast flood on FLOOD_IFACE (e.g. a sibling veth), added
+#           by default when `-f` is specified
+#
+# The hogs are unpinned, unless a CPU list is specified with `-P`.
+# The interference is stored in the `interference` field of the records,
+# while LABEL (free text) goes in their `label` field.
+#
+# With `-S`, SDO transfers are performed concurrently with the cyclic
+# loop: SDO is passed verbatim to `--sdo` (e.g. `100` or `100@0x1018:1`).
+#
+# With `-B`, a cable break is simulated in every window: BREAK is passed
+# verbatim to `--break` (e.g. `vtest1@500:200`). Combine it with `-a`
+# (`--send-ahead`) to check the recovery of the refresh frames too.
+#
+# Every run appends a result record to DATASET: a CSV file or, if its
+# name ends with `.json`, a JSON Lines file. Records from different
+# runs, stacks and hosts can be accumulated in the same DATASET. When
+# not specified, a temporary CSV file is used and dumped at the end.
+#
+# The niceness sweep is performed by a single process (see `--sweep`),
+# so the bus is started only once for every configuration.
+#
+# If more than one interface is specified (e.g. veth pairs connected to
+# different EtherCAT simulators), an independent instance is run on
+# every interface in parallel. Each instance is pinned to a different
+# CPU, picked from the isolated ones (`isolcpus=`) when available: the
+# test is refused if there are not enough of them. If an instance
+# fails, the others are stopped and the test is aborted.
 #
 # The time measured should give an idea of the stack overhead. In
 # pseudocode:
@@ -18,24 +60,101 @@ die() {
     exit 1
 }
 
-stress=$(command -v stress)
-test -x "$stress" || die 'You need to install `stress`'
+usage="Usage: $0 [-o DATASET] [-l LABEL] [-i IFACE[,IFACE...]] [-I INTERFERENCES] [-f FLOOD_IFACE] [-P CPUS] [-S SDO] [-B BREAK] [-a] STACK [PERIOD] [NIC_PROFILE]"
+dataset=
+label=
+ifaces=("")
+interferences=
+flood=
+pin_args=
+sdo_args=
+break_args=
+ahead_args=
+while getopts "o:l:i:I:f:P:S:B:a" opt; do
+    case $opt in
+        o) dataset=$OPTARG ;;
+        l) label=$OPTARG ;;
+        i) IFS=, read -r -a ifaces <<< "$OPTARG" ;;
+        I) interferences=$OPTARG ;;
+        f) flood=$OPTARG ;;
+        P) pin_args="--pin $OPTARG" ;;
+        S) sdo_args="--sdo $OPTARG" ;;
+        B) break_args="--break $OPTARG" ;;
+        a) ahead_args="--send-ahead" ;;
+        *) die "$usage" ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+if test -z "$interferences"; then
+    interferences=idle,cpu,memory,cache,io
+    test -n "$flood" && interferences=$interferences,net
+fi
+
+load="./zig-out/bin/ethercatest-load"
+test -x "$load" || die "'$load' not found: did you run 'zig build'?"
 test -n "$1" || die 'You need to specify an EtherCAT stack (soem, gatorcat or igh)'
 
 stack=$1
 binary="./zig-out/bin/ethercatest-$stack"
 test -x "$binary" || die "'$stack' is not a valid EtherCAT stack"
+test "$stack" = igh -a ${#ifaces[@]} -gt 1 && die 'IgH can drive only one master'
 
 test -z "$2" && period=1000 || period=$2
+test -z "$3" && nic_args= || nic_args="--nic-profile $3"
+test "$stack" = igh -a -n "$nic_args" -a -z "${ifaces[0]}" && die 'IgH needs -i IFACE to apply a NIC profile'
 
+sweep=$(seq -s, -20 2 0)
+warmup=1000
 
-set -o pipefail
+dump_dataset=
+if test -z "$dataset"; then
+    dataset=$(mktemp --suffix .csv)
+    dump_dataset=1
+fi
+tmpdir=$(mktemp -d)
+# The test programs pick the format from the extension of the output
+test "${dataset%.json}" != "$dataset" && records_ext=json || records_ext=csv
 
 
+# Print the CPUs available for pinning, one per line
+get_cpus() {
+    local list item
+    list=$(cat /sys/devices/system/cpu/isolated 2> /dev/null)
+    test -z "$list" && list=$(cat /sys/devices/system/cpu/online)
+    for item in ${list//,/ }; do
+        case $item in
+            *-*) seq ${item%-*} ${item#*-} ;;
+            *)   echo $item ;;
+        esac
+    done
+}
+
+# Append the records in $1 to the dataset, skipping the CSV header
+# if the dataset already has one: a different header means the dataset
+# comes from another version, where the columns would not line up
+append_records() {
+    local records=$1
+    if test ! -s "$dataset" -o "${dataset%.json}" != "$dataset"; then
+        cat "$records" >> "$dataset"
+    elif test "$(head -n 1 "$records")" = "$(head -n 1 "$dataset")"; then
+        tail -n +2 "$records" >> "$dataset"
+    else
+        die "'$dataset' has different columns: use a new dataset"
+    fi
+}
+
 single_run() {
-    local niceness=$1
-    local period=$2
-    nice -n$niceness $binary -q $period 2>&1 | awk '/^Iteration time/ { print $5 ", " $7 ", " $9 ", " $11 }'
+    local output=$1
+    local interference=$2
+    local cpu=$3
+    local iface=$4
+    local pin=
+    test -n "$cpu" && pin="taskset -c $cpu"
+    # Throw away the records of a previous failed attempt
+    rm -f "$output"
+    $pin $binary -q $nic_args $sdo_args $break_args $ahead_args -o "$output" ${label:+-l "$label"} -e "$interference" \
+        -w $warmup -s "$sweep" $iface $period > /dev/null 2>&1
 }
 
 run_test() {
@@ -44,36 +163,94 @@ run_test() {
         :
     else
         die "** ERROR DURING THE RUN: do you have root privileges? The interface is up?"
-        exit 1
     fi
 }
 
+# Kill the instances still running: the subshells first, so they do
+# not retry, then the test programs they started
+instance_pids=
+stop_instances() {
+    local pid children
+    for pid in $instance_pids; do
+        # Dead subshells have their children reparented: list them first
+        children=$(pgrep -P $pid)
+        kill $pid $children 2> /dev/null
+    done
+    instance_pids=
+}
+
 run_tests() {
-    local busy=$1
-    local period=$2
-    # Warm up: throw the first run
-    run_test -20 $period > /dev/null
-    for niceness in $(seq -20 2 0); do
-        printf "\"$stack\", $busy, $niceness, $period, "
-        run_test $niceness $period
+    local interference=$1
+    local n iface cpu
+
+    for n in "${!ifaces[@]}"; do
+        iface=${ifaces[n]}
+        cpu=
+        test ${#ifaces[@]} -gt 1 && cpu=${cpus[n]}
+        echo "Running $stack ($interference) on ${iface:-the default interface}${cpu:+, CPU $cpu}..." >&2
+        run_test "$tmpdir/$n.$records_ext" "$interference" "$cpu" "$iface" &
+        instance_pids="$instance_pids $!"
+    done
+
+    # Any failure aborts the whole run, without waiting for the others
+    for n in "${!ifaces[@]}"; do
+        wait -n || exit 1
+    done
+    instance_pids=
+
+    for n in "${!ifaces[@]}"; do
+        append_records "$tmpdir/$n.$records_ext"
     done
 }
 
 
-printf "Stack, Busy, Niceness, Period, Min time, Max time, Total time, Errors\n"
-run_tests 0 $period
+# Print the `ethercatest-load` arguments for the interference in $1
+get_load_args() {
+    local ncpus=$(nproc)
+    case $1 in
+        idle)   ;;
+        cpu)    echo "--cpu 256" ;;
+        memory) echo "--memory $ncpus" ;;
+        cache)  echo "--cache $ncpus" ;;
+        io)     echo "--disk 4" ;;
+        net)    test -n "$flood" || die "'net' interference requires -f"
+                echo "--flood $flood" ;;
+        *)      die "'$1' is not a valid interference" ;;
+    esac
+}
 
 
-stress_pid=
-kill_stress() {
-    test -n "$stress_pid" && kill $stress_pid
+load_pid=
+stop_load() {
+    test -n "$load_pid" && kill $load_pid
+    load_pid=
+}
+
+cleanup() {
+    stop_instances
+    stop_load
+    if test -n "$dump_dataset"; then
+        cat "$dataset"
+        rm -f "$dataset"
+    fi
+    rm -rf "$tmpdir"
     exit
 }
-trap kill_stress INT TERM EXIT
+trap cleanup INT TERM EXIT
 
-( "$stress" --quiet --cpu 256 ) &
-stress_pid=$!
+# Every parallel instance needs a CPU of its own
+cpus=($(get_cpus))
+if test ${#ifaces[@]} -gt 1 -a ${#cpus[@]} -lt ${#ifaces[@]}; then
+    die "${#ifaces[@]} instances but only ${#cpus[@]} CPUs to pin them: isolate more CPUs"
+fi
 
 
-# Repeat the same tests with busy CPU
-run_tests 1 $period
+for interference in ${interferences//,/ }; do
+    load_args=$(get_load_args $interference) || exit 1
+    if test -n "$load_args"; then
+        $load $pin_args $load_args > /dev/null &
+        load_pid=$!
+    fi
+    run_tests $interference
+    stop_load
+done
@@ -11,22 +11,76 @@ const info = std.debug.print;
 
 const ArgumentsError = error{
     InterfaceAlreadyDefined,
+    InvalidOption,
+};
+
+const SetupError = error{
+    NicProfileFailed,
+    SchedulingFailed,
+    ReportFailed,
+    MailboxFailed,
+    CaptureFailed,
 };
 
 fn usage() void {
     const help =
-        \\Usage: ethercatest-gatorcat [INTERFACE] [PERIOD]
+        \\Usage: ethercatest-gatorcat [-q|--quiet] [OPTIONS] [INTERFACE] [PERIOD]
         \\  [INTERFACE] Ethernet device to use (e.g. 'eth0')
         \\  [PERIOD]    Scantime in us (0 for roundtrip performances)
         \\
     ;
     info(help, .{});
+    c.options_usage();
 }
 
 fn getValidInterface() [:0]const u8 {
     return std.mem.span(c.get_default_interface());
 }
 
+// Everything is allocated from this preallocated arena, so whatever
+// the loop does it cannot end up in the system allocator
+var arena: [8 * 1024 * 1024]u8 = undefined;
+
+/// Forward everything to `child`, counting the allocations with
+/// `memcheck_count_allocation()` so they are included in the report.
+const CountingAllocator = struct {
+    child: std.mem.Allocator,
+
+    pub fn allocator(self: *CountingAllocator) std.mem.Allocator {
+        return .{
+            .ptr = self,
+            .vtable = &.{
+                .alloc = alloc,
+                .resize = resize,
+                .remap = remap,
+                .free = free,
+            },
+        };
+    }
+
+    fn alloc(ctx: *anyopaque, len: usize, alignment: std.mem.Alignment, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        c.memcheck_count_allocation();
+        return self.child.rawAlloc(len, alignment, ret_addr);
+    }
+
+    fn resize(ctx: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) bool {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        return self.child.rawResize(memory, alignment, new_len, ret_addr);
+    }
+
+    fn remap(ctx: *anyopaque, memory: []u8, alignment: std.mem.Alignment, new_len: usize, ret_addr: usize) ?[*]u8 {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        c.memcheck_count_allocation();
+        return self.child.rawRemap(memory, alignment, new_len, ret_addr);
+    }
+
+    fn free(ctx: *anyopaque, memory: []u8, alignment: std.mem.Alignment, ret_addr: usize) void {
+        const self: *CountingAllocator = @ptrCast(@alignCast(ctx));
+        self.child.rawFree(memory, alignment, ret_addr);
+    }
+};
+
 const FieldbusCallback = *const fn (fieldbus: *Fieldbus) void;
 
 fn digital_counter(fieldbus: *Fieldbus) void {
@@ -41,28 +95,52 @@ fn digital_counter(fieldbus: *Fieldbus) void {
     el2808.runtime_info.pi.outputs[0] = @truncate(fieldbus.iteration / 20);
 }
 
+fn sdoTransaction(data: ?*anyopaque, options: [*c]const c.Options) callconv(.c) c_int {
+    const fieldbus: *Fieldbus = @ptrCast(@alignCast(data));
+    fieldbus.sdoTransaction(options) catch return c.FALSE;
+    return c.TRUE;
+}
+
 const Fieldbus = struct {
     allocator: std.mem.Allocator = undefined,
     iface: ?[:0]const u8 = null,
     period: u32 = 5000,
     silent: bool = false,
+    options: c.Options = undefined,
+    report: c.Report = undefined,
+    mailbox: c.Mailbox = undefined,
+    capture: c.Capture = undefined,
+    sdo_subdevice: usize = 0,
     socket: ?gcat.nic.RawSocket = null,
     port: ?gcat.Port = null,
     eni: ?gcat.Arena(gcat.ENI) = null,
     md: ?gcat.MainDevice = null,
     iteration: u64 = 0,
     iteration_time: i64 = 0,
+    wkc: u16 = 0,
 
     pub fn initFromArgs(self: *Fieldbus, allocator: std.mem.Allocator) !bool {
         self.allocator = allocator;
         errdefer self.deinit();
+        c.options_initialize(&self.options);
 
-        var args = std.process.args();
+        // Using the raw argv, so the shared options can be parsed
+        // by the same C code used by the other test programs
+        const argc: c_int = @intCast(std.os.argv.len);
+        const argv: [*c][*c]u8 = @ptrCast(std.os.argv.ptr);
 
         // Skip the first argument (the program name)
-        _ = args.next();
+        var n: c_int = 1;
+        while (n < argc) : (n += 1) {
+            const status = c.options_parse(&self.options, argc, argv, &n);
+            if (status < 0) {
+                usage();
+                return ArgumentsError.InvalidOption;
+            } else if (status > 0) {
+                continue;
+            }
 
-        while (args.next()) |arg| {
+            const arg = std.mem.span(std.os.argv[@intCast(n)]);
             if (std.mem.eql(u8, arg, "-h") or std.mem.eql(u8, arg, "--help")) {
                 usage();
                 self.deinit();
@@ -75,9 +153,8 @@ const Fieldbus = struct {
                 if (self.iface) |_| {
                     return ArgumentsError.InterfaceAlreadyDefined;
                 } else {
-                    // Using the allocator here because I'm not sure
-                    // the memory pointed by `arg`
-                    // survives to the next `args.next()` call
+                    // Duplicating it, so `deinit()` can free
+                    // `self.iface` regardless of its origin
                     self.iface = try allocator.dupeZ(u8, arg);
                 }
             }
@@ -108,9 +185,25 @@ const Fieldbus = struct {
         }
     }
 
+    pub fn getInterface(self: *Fieldbus) ![:0]const u8 {
+        if (self.iface == null) {
+            self.iface = try self.allocator.dupeZ(u8, getValidInterface());
+        }
+        return self.iface.?;
+    }
+
+    pub fn setupNic(self: *Fieldbus) !void {
+        const nic = &self.report.nic;
+        if (c.nic_setup(nic, (try self.getInterface()).ptr, &self.options) == 0) {
+            return SetupError.NicProfileFailed;
+        }
+        c.nic_dump(nic);
+        c.report_phase(&self.report, "nic");
+    }
+
     fn getSocket(self: *Fieldbus) !*gcat.nic.RawSocket {
         if (self.socket == null) {
-            const iface = self.iface orelse getValidInterface();
+            const iface = try self.getInterface();
             self.socket = try gcat.nic.RawSocket.init(iface);
             info("gcat.nic.RawSocket.init('{s}') succeeded\n", .{ iface });
         }
@@ -171,17 +264,23 @@ const Fieldbus = struct {
     pub fn activate(self: *Fieldbus) !void {
         const md = try self.getMD();
 
+        c.report_phase(&self.report, "config");
+
         try md.*.busInit(5_000_000);
         info("Switched to INIT\n", .{});
+        c.report_phase(&self.report, "init");
 
         try md.*.busPreop(10_000_000);
         info("Switched to PREOP\n", .{});
+        c.report_phase(&self.report, "preop");
 
         try md.*.busSafeop(10_000_000);
         info("Switched to SAFE-OP\n", .{});
+        c.report_phase(&self.report, "safeop");
 
         try md.*.busOp(10_000_000);
         info("Switched to OP\n", .{});
+        c.report_phase(&self.report, "op");
 
         try md.*.sendCyclicFrames();
         info("Send initial packet\n", .{});
@@ -190,75 +289,157 @@ const Fieldbus = struct {
     pub fn iterate(self: *Fieldbus, callback: ?FieldbusCallback) !void {
         const md = try self.getMD();
 
+        const reaction = &self.report.reaction;
         const start = c.get_monotonic_time();
 
-        _ = try md.*.recvCyclicFrames();
+        self.wkc = (try md.*.recvCyclicFrames()).process_data_wkc;
+        if (reaction.send_ahead != 0) {
+            // Refresh the inputs: the reception waits for the frames
+            // (up to `recv_timeout_us`), so no need to wait for them.
+            // A lost refresh frame leaves the inputs stale: account
+            // it as a null working counter
+            try md.*.sendCyclicFrames();
+            c.reaction_sent(reaction, c.get_monotonic_time(), c.FALSE);
+            const ok = if (md.*.recvCyclicFrames()) |refreshed| blk: {
+                self.wkc = refreshed.process_data_wkc;
+                break :blk true;
+            } else |_| blk: {
+                self.wkc = 0;
+                break :blk false;
+            };
+            c.reaction_received(reaction, c.get_monotonic_time(), @intFromBool(ok));
+        }
         if (callback) |cycle| {
             cycle(self);
         }
         try md.*.sendCyclicFrames();
 
         const stop = c.get_monotonic_time();
+        c.reaction_sent(reaction, stop, c.TRUE);
 
         self.iteration += 1;
         self.iteration_time = stop - start;
     }
 
+    pub fn sdoTransaction(self: *Fieldbus, options: *const c.Options) !void {
+        const md = try self.getMD();
+        const port = try self.getPort();
+        const subdevices = md.*.subdevices;
+
+        // Round robin on the subdevices supporting CoE: gatorcat sets
+        // up the CoE state only when the SII declares the protocol
+        var candidate = self.sdo_subdevice;
+        for (0..subdevices.len) |_| {
+            candidate = (candidate + 1) % subdevices.len;
+            if (subdevices[candidate].runtime_info.coe != null) {
+                break;
+            }
+        } else {
+            return error.NoMailbox;
+        }
+        self.sdo_subdevice = candidate;
+        const subdevice = &subdevices[self.sdo_subdevice];
+
+        var buffer: [64]u8 = undefined;
+        const size = try subdevice.sdoRead(
+            port,
+            &buffer,
+            options.sdo_index,
+            options.sdo_subindex,
+            false,
+            100_000,
+            100_000,
+        );
+        if (options.sdo_write != 0) {
+            try subdevice.sdoWrite(
+                port,
+                buffer[0..size],
+                options.sdo_index,
+                options.sdo_subindex,
+                false,
+                100_000,
+                100_000,
+            );
+        }
+    }
+
+    pub fn expectedWkc(self: *const Fieldbus) u16 {
+        return if (self.md) |*md| md.expectedProcessDataWkc() else 0;
+    }
+
     pub fn dump(self: *const Fieldbus) void {
-        info("Iteration {d}: {d} usec\r", .{
-            self.iteration, self.iteration_time
+        info("Iteration {d}: {d:.3} usec\r", .{
+            self.iteration, @as(f64, @floatFromInt(self.iteration_time)) / 1000.0
         });
     }
 };
 
 
 pub fn main() !void {
-    var gpa = std.heap.GeneralPurposeAllocator(.{}){};
-    defer _ = gpa.deinit();
+    var fba = std.heap.FixedBufferAllocator.init(&arena);
+    var counting = CountingAllocator{ .child = fba.allocator() };
 
     var fieldbus = Fieldbus{};
-    if (! try fieldbus.initFromArgs(gpa.allocator())) {
+    if (! try fieldbus.initFromArgs(counting.allocator())) {
         return;
     }
     defer fieldbus.deinit();
 
+    if (c.report_initialize(&fieldbus.report, "gatorcat", &fieldbus.options) == 0) {
+        return SetupError.ReportFailed;
+    }
+    fieldbus.report.period = fieldbus.period;
+    try fieldbus.setupNic();
+    if (c.capture_start(&fieldbus.capture, (try fieldbus.getInterface()).ptr, fieldbus.options.capture) == 0) {
+        return SetupError.CaptureFailed;
+    }
+    defer c.capture_stop(&fieldbus.capture);
     try fieldbus.activate();
 
-    var min_time: i64 = 0;
-    var max_time: i64 = 0;
-    var total_time: i64 = 0;
-    var errors: u32 = 0;
-    const iterations: u64 = 100_000 / (fieldbus.period / 100 + 3);
+    if (c.mailbox_start(&fieldbus.mailbox, sdoTransaction, &fieldbus, &fieldbus.options) == 0) {
+        return SetupError.MailboxFailed;
+    }
+    defer c.mailbox_stop(&fieldbus.mailbox);
+    fieldbus.report.mailbox = &fieldbus.mailbox;
+
     const cycle: ?FieldbusCallback = if (fieldbus.period > 0) digital_counter else null;
+    const options = &fieldbus.options;
 
-    info("Starting loop cycle with {d} us period\n", .{
-        fieldbus.period
-    });
-    while (fieldbus.iteration < iterations) {
-        fieldbus.iterate(cycle) catch |err| {
-            errors += 1;
-            info("\nIteration error: status {}\n", .{ err });
-            continue;
-        };
-        if (! fieldbus.silent) {
-            fieldbus.dump();
+    // Window -1, if present, is the warm-up
+    var window: c_int = if (options.warmup > 0) -1 else 0;
+    while (window < c.options_get_windows(options)) : (window += 1) {
+        if (c.report_begin_window(&fieldbus.report, options, window) == 0) {
+            return SetupError.SchedulingFailed;
         }
+        const iterations: u64 = if (window < 0)
+            options.warmup
+        else
+            c.options_get_iterations(options, fieldbus.period);
+        const last = fieldbus.iteration + iterations;
+
+        info("Starting loop cycle with {d} us period\n", .{
+            fieldbus.period
+        });
+        while (fieldbus.iteration < last) {
+            fieldbus.iterate(cycle) catch |err| {
+                fieldbus.report.errors += 1;
+                info("\nIteration error: status {}\n", .{ err });
+                continue;
+            };
+            if (! fieldbus.silent) {
+                fieldbus.dump();
+            }
+            if (fieldbus.wkc != fieldbus.expectedWkc()) {
+                fieldbus.report.wkc_errors += 1;
+            }
 
-        const time = fieldbus.iteration_time;
-        if (max_time == 0) {
-            min_time = time;
-            max_time = time;
-        } else if (time < min_time) {
-            min_time = time;
-        } else if (time > max_time) {
-            max_time = time;
+            const time = fieldbus.iteration_time;
+            c.report_add(&fieldbus.report, time);
+            c.scheduler_wait(&fieldbus.report.scheduler, time);
         }
 
-        total_time += time;
-        c.wait_next_iteration(time, fieldbus.period);
+        if (c.report_end_window(&fieldbus.report, options) == 0) {
+            return SetupError.ReportFailed;
+        }
     }
-
-    info("\nIteration time (usec): min {d}  max {d}  total {d}  errors {d}\n", .{
-        min_time, max_time, total_time, errors
-    });
 }
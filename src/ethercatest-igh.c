@@ -21,19 +21,53 @@
 #include "ethercatest.h"
 #include <ecrt.h>
 #include <inttypes.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/time.h>
 #include <unistd.h>
 
+/* Upper bound of the Ethernet devices used by a master */
+#define MAX_LINKS   4
+
+
+typedef struct {
+    ec_pdo_info_t pdo_info;
+    ec_pdo_entry_info_t *entries;
+} Pdo;
+
+typedef struct {
+    ec_sync_info_t sync_info;
+    Pdo *pdos;
+} Sync;
+
+/* In-memory copy of the slave topology, fetched once at startup */
+typedef struct {
+    ec_slave_info_t slave_info;
+    Sync *syncs;
+    ec_slave_config_t *config;
+    unsigned al_state;
+    /* When INIT, PREOP, SAFEOP and OP have been observed (nsec
+     * since the activation), -1 if never */
+    int64_t reached[4];
+} Slave;
 
 typedef struct {
     ec_master_t *master;
     ec_master_info_t master_info;
+    Slave *slaves;
+    unsigned ioctls;
+    int64_t backoff_min;
+    int64_t backoff_max;
+    int64_t startup_timeout;
     ec_domain_t *domain;
     ec_domain_state_t domain_state;
     int64_t iteration_time;
     uint64_t iteration;
     uint8_t *map;
+    Report report;
+    Mailbox mailbox;
+    Capture capture;
+    uint16_t sdo_slave;
 } Fieldbus;
 
 typedef struct TraverserData_ TraverserData;
@@ -49,10 +83,10 @@ struct TraverserData_ {
     int                 npdo;
     int                 nentry;
 
-    ec_slave_info_t     slave;
-    ec_sync_info_t      sync;
-    ec_pdo_info_t       pdo;
-    ec_pdo_entry_info_t entry;
+    const Slave *               slave;
+    const ec_sync_info_t *      sync;
+    const ec_pdo_info_t *       pdo;
+    const ec_pdo_entry_info_t * entry;
 };
 
 typedef struct {
@@ -64,6 +98,16 @@ typedef struct {
 
 typedef void (*FieldbusCallback)(Fieldbus *);
 
+static const unsigned al_states[] = {
+    EC_AL_STATE_INIT,
+    EC_AL_STATE_PREOP,
+    EC_AL_STATE_SAFEOP,
+    EC_AL_STATE_OP,
+};
+static const char *al_state_names[] = { "INIT", "PREOP", "SAFEOP", "OP" };
+/* Phase names when all the slaves reached a state */
+static const char *al_state_phases[] = { "init", "preop", "safeop", "op" };
+
 
 static void
 fieldbus_initialize(Fieldbus *self)
@@ -76,6 +120,9 @@ fieldbus_initialize(Fieldbus *self)
     self->map = NULL;
     self->iteration = 0;
     self->iteration_time = 0;
+    self->backoff_min = 500;
+    self->backoff_max = 4000;
+    self->startup_timeout = 10000000000;
 }
 
 static int
@@ -112,8 +159,9 @@ fieldbus_receive(Fieldbus *self)
 static int
 fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
 {
+    Reaction *reaction = &self->report.reaction;
     int64_t start, stop;
-    int status;
+    int status, back;
 
     start = get_monotonic_time();
 
@@ -121,6 +169,25 @@ fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
     if (status < 0) {
         return status;
     }
+    if (reaction->send_ahead) {
+        /* Refresh the inputs: ecrt_master_receive() does not wait
+         * for the frame, so poll until the working counter shows it
+         * back or the adaptive lead expires */
+        status = fieldbus_send(self);
+        if (status < 0) {
+            return status;
+        }
+        reaction_sent(reaction, get_monotonic_time(), FALSE);
+        back = FALSE;
+        while (! back && reaction_wait(reaction)) {
+            status = fieldbus_receive(self);
+            if (status < 0) {
+                return status;
+            }
+            back = self->domain_state.wc_state != EC_WC_ZERO;
+        }
+        reaction_received(reaction, get_monotonic_time(), back);
+    }
     if (callback != NULL) {
         callback(self);
     }
@@ -130,6 +197,7 @@ fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
     }
 
     stop = get_monotonic_time();
+    reaction_sent(reaction, stop, TRUE);
 
     ++self->iteration;
     self->iteration_time = stop - start;
@@ -137,25 +205,52 @@ fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
 }
 
 static int
-traverse_pdo(TraverserData *data)
+load_pdo(Fieldbus *self, unsigned nslave, unsigned nsync, unsigned npdo, Pdo *pdo)
 {
-    if (ecrt_master_get_pdo(data->fieldbus->master,
-                            data->nslave, data->nsync,
-                            data->npdo, &data->pdo) != 0) {
-        info("failed to get PDO %d from sync manager %d from slave %d\n",
-             data->npdo, data->nsync, data->nslave);
+    unsigned n;
+
+    ++self->ioctls;
+    if (ecrt_master_get_pdo(self->master, nslave, nsync, npdo, &pdo->pdo_info) != 0) {
+        info("failed to get PDO %u from sync manager %u from slave %u\n",
+             npdo, nsync, nslave);
+        return FALSE;
+    }
+
+    pdo->entries = calloc(pdo->pdo_info.n_entries, sizeof(ec_pdo_entry_info_t));
+    if (pdo->entries == NULL && pdo->pdo_info.n_entries > 0) {
         return FALSE;
     }
 
-    for (data->nentry = 0; data->nentry < data->pdo.n_entries; ++data->nentry) {
-        if (ecrt_master_get_pdo_entry(data->fieldbus->master, data->nslave,
-                                      data->nsync, data->npdo,
-                                      data->nentry, &data->entry) != 0) {
-            info("failed to get entry %d of PDO %d from sync manager %d from slave %d\n",
-                 data->nentry, data->npdo, data->nsync, data->nslave);
+    for (n = 0; n < pdo->pdo_info.n_entries; ++n) {
+        ++self->ioctls;
+        if (ecrt_master_get_pdo_entry(self->master, nslave, nsync, npdo,
+                                      n, pdo->entries + n) != 0) {
+            info("failed to get entry %u of PDO %u from sync manager %u from slave %u\n",
+                 n, npdo, nsync, nslave);
             return FALSE;
         }
-        if (! data->callback(data)) {
+    }
+    return TRUE;
+}
+
+static int
+load_sync(Fieldbus *self, unsigned nslave, unsigned nsync, Sync *sync)
+{
+    unsigned n;
+
+    ++self->ioctls;
+    if (ecrt_master_get_sync_manager(self->master, nslave, nsync, &sync->sync_info) != 0) {
+        info("failed to get sync manager %u from slave %u\n", nsync, nslave);
+        return FALSE;
+    }
+
+    sync->pdos = calloc(sync->sync_info.n_pdos, sizeof(Pdo));
+    if (sync->pdos == NULL && sync->sync_info.n_pdos > 0) {
+        return FALSE;
+    }
+
+    for (n = 0; n < sync->sync_info.n_pdos; ++n) {
+        if (! load_pdo(self, nslave, nsync, n, sync->pdos + n)) {
             return FALSE;
         }
     }
@@ -163,70 +258,125 @@ traverse_pdo(TraverserData *data)
 }
 
 static int
-traverse_sync(TraverserData *data)
+load_slave(Fieldbus *self, unsigned nslave, Slave *slave)
 {
-    if (ecrt_master_get_sync_manager(data->fieldbus->master,
-                                     data->nslave, data->nsync,
-                                     &data->sync) != 0) {
-        info("failed to get sync manager %d from slave %d\n",
-             data->nsync, data->nslave);
+    unsigned n;
+
+    ++self->ioctls;
+    if (ecrt_master_get_slave(self->master, nslave, &slave->slave_info) != 0) {
+        info("failed to fetch information from slave %u\n", nslave);
+        return FALSE;
+    }
+
+    slave->syncs = calloc(slave->slave_info.sync_count, sizeof(Sync));
+    if (slave->syncs == NULL && slave->slave_info.sync_count > 0) {
         return FALSE;
     }
 
-    for (data->npdo = 0; data->npdo < data->sync.n_pdos; ++data->npdo) {
-        if (! traverse_pdo(data)) {
+    for (n = 0; n < slave->slave_info.sync_count; ++n) {
+        if (! load_sync(self, nslave, n, slave->syncs + n)) {
             return FALSE;
         }
     }
+
+    /* Create a slave configuration for every slave, so the AL state
+     * of each of them can be monitored with ecrt_slave_config_state()
+     * and all of them (couplers included) are requested to go in OP */
+    ++self->ioctls;
+    slave->config = ecrt_master_slave_config(self->master, 0, nslave,
+                                             slave->slave_info.vendor_id,
+                                             slave->slave_info.product_code);
+    if (slave->config == NULL) {
+        info("unable to configure slave %u\n", nslave);
+        return FALSE;
+    }
+
+    for (n = 0; n < 4; ++n) {
+        slave->reached[n] = -1;
+    }
     return TRUE;
 }
 
+/* Fetch the whole topology (slaves, sync managers, PDOs and PDO
+ * entries) in a single pass: all the traversals are then performed
+ * in memory, without further ioctl calls */
 static int
-traverse_slave(TraverserData *data)
+fieldbus_scan_slaves(Fieldbus *self)
 {
-    if (ecrt_master_get_slave(data->fieldbus->master,
-                              data->nslave, &data->slave) != 0) {
-        info("failed to fetch information from slave %d\n", data->nslave);
+    unsigned n;
+
+    self->slaves = calloc(self->master_info.slave_count, sizeof(Slave));
+    if (self->slaves == NULL && self->master_info.slave_count > 0) {
         return FALSE;
     }
 
-    for (data->nsync = 0; data->nsync < data->slave.sync_count; ++data->nsync) {
-        if (! traverse_sync(data)) {
+    for (n = 0; n < self->master_info.slave_count; ++n) {
+        if (! load_slave(self, n, self->slaves + n)) {
             return FALSE;
         }
     }
+
     return TRUE;
 }
 
+static void
+fieldbus_free_slaves(Fieldbus *self)
+{
+    Slave *slave;
+    Sync *sync;
+    unsigned n, s, p;
+
+    if (self->slaves == NULL) {
+        return;
+    }
+
+    for (n = 0; n < self->master_info.slave_count; ++n) {
+        slave = self->slaves + n;
+        for (s = 0; slave->syncs != NULL && s < slave->slave_info.sync_count; ++s) {
+            sync = slave->syncs + s;
+            for (p = 0; sync->pdos != NULL && p < sync->sync_info.n_pdos; ++p) {
+                free(sync->pdos[p].entries);
+            }
+            free(sync->pdos);
+        }
+        free(slave->syncs);
+    }
+    free(self->slaves);
+    self->slaves = NULL;
+}
+
 static int
 fieldbus_traverse_pdo_entries(Fieldbus *self,
                               TraverserCallback callback, void *context)
 {
     TraverserData data;
+    const Sync *sync;
+    const Pdo *pdo;
+
     data.fieldbus = self;
     data.callback = callback;
     data.context  = context;
     for (data.nslave = 0; data.nslave < self->master_info.slave_count; ++data.nslave) {
-        if (! traverse_slave(&data)) {
-            return FALSE;
+        data.slave = self->slaves + data.nslave;
+        for (data.nsync = 0; data.nsync < data.slave->slave_info.sync_count; ++data.nsync) {
+            sync = data.slave->syncs + data.nsync;
+            data.sync = &sync->sync_info;
+            for (data.npdo = 0; data.npdo < sync->sync_info.n_pdos; ++data.npdo) {
+                pdo = sync->pdos + data.npdo;
+                data.pdo = &pdo->pdo_info;
+                for (data.nentry = 0; data.nentry < pdo->pdo_info.n_entries; ++data.nentry) {
+                    data.entry = pdo->entries + data.nentry;
+                    if (! data.callback(&data)) {
+                        return FALSE;
+                    }
+                }
+            }
         }
     }
 
     return TRUE;
 }
 
-static ec_slave_config_t *
-traverser_get_slave_config(TraverserData *data)
-{
-    ec_slave_config_t *sc;
-    sc = ecrt_master_slave_config(data->fieldbus->master, 0, data->nslave,
-                                  data->slave.vendor_id, data->slave.product_code);
-    if (sc == NULL) {
-        info("unable to configure slave %d\n", data->nslave);
-    }
-    return sc;
-}
-
 static void
 dump_configuration(TraverseConfiguration *configuration)
 {
@@ -265,12 +415,12 @@ traverser_configurer(TraverserData *data)
     unsigned bitpos;
     int is_digital;
 
-    if (configuration->dir != data->sync.dir) {
+    if (configuration->dir != data->sync->dir) {
         return TRUE;
     }
 
-    sc = traverser_get_slave_config(data);
-    bytepos = ecrt_slave_config_reg_pdo_entry(sc, data->entry.index, data->entry.subindex,
+    sc = data->slave->config;
+    bytepos = ecrt_slave_config_reg_pdo_entry(sc, data->entry->index, data->entry->subindex,
                                               data->fieldbus->domain, &bitpos);
     if (bytepos < 0) {
         info("failed to register entry %d on PDO %d on sync manager %d on slave %d\n",
@@ -279,7 +429,7 @@ traverser_configurer(TraverserData *data)
     }
 
     /* Update configuration */
-    is_digital = data->entry.bit_length <= 1;
+    is_digital = data->entry->bit_length <= 1;
     if (is_digital != configuration->is_digital) {
         /* Dump the previous configuration */
         dump_configuration(configuration);
@@ -315,11 +465,152 @@ fieldbus_autoconfigure(Fieldbus *self)
     return TRUE;
 }
 
+static const char *
+al_state_name(unsigned al_state)
+{
+    size_t n;
+
+    for (n = 0; n < sizeof(al_states) / sizeof(al_states[0]); ++n) {
+        if (al_states[n] == al_state) {
+            return al_state_names[n];
+        }
+    }
+    return "UNKNOWN";
+}
+
+/* Refresh the AL state of every slave, recording the time of every
+ * transition. Returns the number of slaves that changed state and
+ * stores in `lowest` the lowest AL state on the bus. */
+static int
+fieldbus_poll_slaves(Fieldbus *self, int64_t since, unsigned *lowest)
+{
+    ec_slave_config_state_t state;
+    Slave *slave;
+    int64_t now;
+    unsigned n, s;
+    int changes;
+
+    now = get_monotonic_time() - since;
+    changes = 0;
+    *lowest = EC_AL_STATE_OP;
+
+    for (n = 0; n < self->master_info.slave_count; ++n) {
+        slave = self->slaves + n;
+        if (ecrt_slave_config_state(slave->config, &state) != 0 || ! state.online) {
+            state.al_state = 0;
+        }
+        if (state.al_state != slave->al_state) {
+            slave->al_state = state.al_state;
+            ++changes;
+            for (s = 0; s < 4; ++s) {
+                if (al_states[s] == state.al_state && slave->reached[s] < 0) {
+                    slave->reached[s] = now;
+                }
+            }
+        }
+        if (slave->al_state < *lowest) {
+            *lowest = slave->al_state;
+        }
+    }
+
+    return changes;
+}
+
+static void
+fieldbus_dump_slaves(Fieldbus *self)
+{
+    const Slave *slave;
+    unsigned n, s;
+
+    info("AL state transitions (usec since activation):\n");
+    for (n = 0; n < self->master_info.slave_count; ++n) {
+        slave = self->slaves + n;
+        info("  %3u %-24.24s", n, slave->slave_info.name);
+        for (s = 0; s < 4; ++s) {
+            if (slave->reached[s] >= 0) {
+                info("  %s %.0f", al_state_names[s], USEC(slave->reached[s]));
+            } else {
+                info("  %s -", al_state_names[s]);
+            }
+        }
+        if (slave->al_state != EC_AL_STATE_OP) {
+            info("  (still in %s)", al_state_name(slave->al_state));
+        }
+        info("\n");
+    }
+}
+
+/* The backup device is not configured by the application but when
+ * loading the master module (`backup_devices`): just report what the
+ * master is using, and how the slaves are split between the links */
+static void
+fieldbus_dump_links(Fieldbus *self)
+{
+    ec_master_link_state_t state;
+    unsigned n;
+
+    for (n = 0; n < MAX_LINKS; ++n) {
+        if (ecrt_master_link_state(self->master, n, &state) != 0) {
+            break;
+        }
+        info("Link %u (%s): %s, %u slaves responding\n", n,
+             n == 0 ? "main" : "backup", state.link_up ? "up" : "down",
+             state.slaves_responding);
+    }
+    if (n > 1) {
+        self->report.links = n;
+    } else {
+        info("No backup link: redundancy not available\n");
+    }
+}
+
+/* Keep the bus alive until all the slaves are in OP, polling them
+ * every `delay` usec. The delay is reset to `backoff_min` whenever
+ * some slave changes state and doubled (up to `backoff_max`) when
+ * nothing happens, so transitions are timestamped accurately without
+ * hammering the master while slow slaves are booting */
+static int
+fieldbus_wait_op(Fieldbus *self)
+{
+    int64_t start, delay;
+    unsigned lowest;
+    size_t phase;
+
+    start = get_monotonic_time();
+    delay = self->backoff_min;
+    phase = 0;
+
+    for (;;) {
+        fieldbus_receive(self);
+        fieldbus_send(self);
+
+        if (fieldbus_poll_slaves(self, start, &lowest) > 0) {
+            delay = self->backoff_min;
+        } else if (delay < self->backoff_max) {
+            delay = delay * 2 < self->backoff_max ? delay * 2 : self->backoff_max;
+        }
+
+        /* Record when the whole bus reached every state */
+        while (phase < 4 && lowest >= al_states[phase]) {
+            report_phase(&self->report, al_state_phases[phase]);
+            ++phase;
+        }
+        if (lowest == EC_AL_STATE_OP) {
+            return TRUE;
+        }
+
+        if (get_monotonic_time() - start > self->startup_timeout) {
+            return FALSE;
+        }
+        usleep(delay);
+    }
+}
+
 static int
 fieldbus_start(Fieldbus *self)
 {
-    ec_master_state_t state;
-    int n;
+    int64_t start;
+    int status;
 
     if (self->master != NULL) {
         /* Fieldbus already configured: just bail out */
@@ -335,6 +626,7 @@ fieldbus_start(Fieldbus *self)
         return FALSE;
     }
     info("done\n");
+    report_phase(&self->report, "request");
 
     info("Creating domain... ");
     self->domain = ecrt_master_create_domain(self->master);
@@ -344,12 +636,23 @@ fieldbus_start(Fieldbus *self)
     }
     info("done\n");
 
+    info("Scanning slaves... ");
+    start = get_monotonic_time();
+    if (! fieldbus_scan_slaves(self)) {
+        info("failed\n");
+        return FALSE;
+    }
+    info("%u ioctl calls in %.3f usec\n",
+         self->ioctls, USEC(get_monotonic_time() - start));
+    report_phase(&self->report, "scan");
+
     info("Autoconfiguring slaves... ");
     if (! fieldbus_autoconfigure(self)) {
         info("failed\n");
         return FALSE;
     }
     info("\n");
+    report_phase(&self->report, "config");
 
     /* Silent application time warning */
     struct timeval tod;
@@ -362,6 +665,7 @@ fieldbus_start(Fieldbus *self)
         return FALSE;
     }
     info("done\n");
+    report_phase(&self->report, "activate");
 
     info("Get domain process data... ");
     self->map = ecrt_domain_data(self->domain);
@@ -372,31 +676,12 @@ fieldbus_start(Fieldbus *self)
     info("done\n");
 
     info("Waiting all slaves in OP state... ");
-    for (n = 0; n < 10000; ++n) {
-        fieldbus_receive(self);
-        fieldbus_send(self);
-        usleep(500);
-        ecrt_master_state(self->master, &state);
-        if (state.al_states == EC_AL_STATE_OP) {
-            break;
-        }
-    }
-    if (state.al_states != EC_AL_STATE_OP) {
-        const char *prefix = "";
-        ec_slave_info_t slave_info;
-        for (n = 0; n < self->master_info.slave_count; ++n) {
-            ecrt_master_get_slave(self->master, n, &slave_info);
-            if (slave_info.al_state != EC_AL_STATE_OP) {
-                info("%s%s still in %u", prefix, slave_info.name, slave_info.al_state);
-                prefix = ", ";
-            }
-        }
-        info("\n");
-        return FALSE;
-    }
-    info("done\n");
+    status = fieldbus_wait_op(self);
+    info(status ? "done\n" : "timeout\n");
+    fieldbus_dump_slaves(self);
+    fieldbus_dump_links(self);
 
-    return TRUE;
+    return status;
 }
 
 static void
@@ -406,6 +691,7 @@ fieldbus_stop(Fieldbus *self)
         ecrt_release_master(self->master);
         self->master = NULL;
     }
+    fieldbus_free_slaves(self);
 }
 
 static void
@@ -414,8 +700,8 @@ fieldbus_dump(Fieldbus *self)
     int wkc = self->domain_state.working_counter;
     int i;
 
-    info("Iteration %" PRIu64 ":  %" PRId64 " usec  WKC %d",
-         self->iteration, self->iteration_time, wkc);
+    info("Iteration %" PRIu64 ":  %.3f usec  WKC %d",
+         self->iteration, USEC(self->iteration_time), wkc);
 
     for (i = 0; i < ecrt_domain_size(self->domain); ++i) {
         info(" %02X", self->map[i]);
@@ -423,6 +709,41 @@ fieldbus_dump(Fieldbus *self)
     info("   \r");
 }
 
+static int
+fieldbus_sdo_transaction(void *data, const Options *options)
+{
+    Fieldbus *self = data;
+    uint8_t buffer[64];
+    size_t size;
+    uint32_t abort_code;
+    unsigned n;
+
+    /* Round robin on the slaves supporting CoE */
+    for (n = 0; n < self->master_info.slave_count; ++n) {
+        self->sdo_slave = (self->sdo_slave + 1) % self->master_info.slave_count;
+        if (self->slaves[self->sdo_slave].slave_info.sdo_count > 0) {
+            break;
+        }
+    }
+    if (n >= self->master_info.slave_count) {
+        return FALSE;
+    }
+
+    if (ecrt_master_sdo_upload(self->master, self->sdo_slave,
+                               options->sdo_index, options->sdo_subindex,
+                               buffer, sizeof(buffer), &size, &abort_code) != 0) {
+        return FALSE;
+    }
+    if (options->sdo_write &&
+        ecrt_master_sdo_download(self->master, self->sdo_slave,
+                                 options->sdo_index, options->sdo_subindex,
+                                 buffer, size, &abort_code) != 0) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static void
 digital_counter(Fieldbus *self)
 {
@@ -431,26 +752,59 @@ digital_counter(Fieldbus *self)
     self->map[0] = self->iteration / 20;
 }
 
+static int
+parse_backoff(Fieldbus *self, const char *text)
+{
+    char *endptr;
+
+    self->backoff_min = strtol(text, &endptr, 10);
+    self->backoff_max = self->backoff_min;
+    if (*endptr == ':') {
+        self->backoff_max = strtol(endptr + 1, &endptr, 10);
+    }
+    if (*text == '\0' || *endptr != '\0' ||
+        self->backoff_min <= 0 || self->backoff_max < self->backoff_min) {
+        info("Invalid backoff '%s'\n", text);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static void
 usage(void)
 {
-    info("Usage: ethercatest-igh [-q|--quiet] [PERIOD]\n"
-         "  [PERIOD] Scantime in us (0 for roundtrip performances)\n");
+    info("Usage: ethercatest-igh [-q|--quiet] [-b|--backoff MIN[:MAX]] [-t|--timeout SECONDS]\n"
+         "                       [OPTIONS] [[-I|--iface] INTERFACE] [PERIOD]\n"
+         "  [INTERFACE] Ethernet device bound to the EtherCAT master, only\n"
+         "              used to read and tune the NIC settings and to\n"
+         "              capture the frames: it is not guessed, so without\n"
+         "              it the NIC is left alone\n"
+         "  [PERIOD]    Scantime in us (0 for roundtrip performances)\n"
+         "  -b, --backoff MIN[:MAX]  Polling interval (usec) while waiting\n"
+         "                           for OP: it starts from MIN and doubles\n"
+         "                           up to MAX while no slave changes state\n"
+         "                           (default 500:4000)\n"
+         "  -t, --timeout SECONDS    Maximum time to wait for OP (default 10)\n");
+    options_usage();
 }
 
 int
 main(int argc, char *argv[])
 {
     Fieldbus fieldbus;
-    const char *arg;
+    Options options;
+    const char *iface, *arg;
     long period;
-    int n, silent;
+    int n, silent, status;
 
     setbuf(stdout, NULL);
 
     fieldbus_initialize(&fieldbus);
+    options_initialize(&options);
 
     /* Parse arguments */
+    iface = NULL;
     period = 5000;
     silent = 0;
 
@@ -461,51 +815,137 @@ main(int argc, char *argv[])
             return 0;
         } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
             silent = 1;
-        } else {
-            period = atoi(arg);
+        } else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--backoff") == 0) {
+            if (n + 1 >= argc || ! parse_backoff(&fieldbus, argv[++n])) {
+                usage();
+                return 1;
+            }
+        } else if (strcmp(arg, "-I") == 0 || strcmp(arg, "--iface") == 0) {
+            if (n + 1 >= argc || iface != NULL) {
+                usage();
+                return 1;
+            }
+            iface = argv[++n];
+        } else if (strcmp(arg, "-t") == 0 || strcmp(arg, "--timeout") == 0) {
+            char *endptr;
+            long value = n + 1 < argc ? strtol(argv[++n], &endptr, 10) : 0;
+            if (value <= 0 || *endptr != '\0') {
+                info("Invalid timeout\n");
+                usage();
+                return 1;
+            }
+            fieldbus.startup_timeout = (int64_t) value * 1000000000;
+        } else if ((status = options_parse(&options, argc, argv, &n)) != 0) {
+            if (status < 0) {
+                usage();
+                return 1;
+            }
+        } else if (arg[0] != '\0') {
+            char *endptr;
+            long value = strtol(arg, &endptr, 10);
+            if (*endptr == '\0') {
+                period = value;
+            } else if (iface != NULL) {
+                info("Invalid arguments.\n");
+                usage();
+                return 1;
+            } else {
+                iface = arg;
+            }
         }
     }
 
+    /* The device used by the master is not known to the network
+     * stack: any default would likely be the wrong (e.g. management) NIC */
+    if (iface == NULL && (options.nic_profile != NULL || options.capture != NULL)) {
+        info("--nic-profile and --capture require an explicit INTERFACE\n");
+        usage();
+        return 1;
+    }
+
+    if (! report_initialize(&fieldbus.report, "igh", &options)) {
+        return 2;
+    }
+    fieldbus.report.period = period;
+    if (iface == NULL) {
+        /* Leave all the NIC settings unknown */
+        nic_get_settings(&fieldbus.report.nic, NULL);
+    } else if (! nic_setup(&fieldbus.report.nic, iface, &options)) {
+        return 2;
+    }
+    nic_dump(&fieldbus.report.nic);
+    report_phase(&fieldbus.report, "nic");
+
+    /* Only works with the generic driver: the native ones bypass
+     * the Linux network stack */
+    if (! capture_start(&fieldbus.capture, iface, options.capture)) {
+        return 2;
+    }
+
     if (! fieldbus_start(&fieldbus)) {
         return 2;
     }
 
-    int64_t min_time = 0;
-    int64_t max_time = 0;
-    int64_t total_time = 0;
-    int errors = 0;
-    uint64_t iterations = 100000 / (period / 100 + 3);
-    FieldbusCallback cycle = period > 0 ? digital_counter : NULL;
+    if (! mailbox_start(&fieldbus.mailbox, fieldbus_sdo_transaction, &fieldbus, &options)) {
+        fieldbus_stop(&fieldbus);
+        return 2;
+    }
+    fieldbus.report.mailbox = &fieldbus.mailbox;
 
-    int status;
-    info("Starting loop cycle with %ld us period\n", period);
-    while (fieldbus.iteration < iterations) {
-        status = fieldbus_iterate(&fieldbus, cycle);
-        if (status < 0) {
-            ++errors;
-            info("\nIteration error: status %d\n", status);
-            continue;
+    FieldbusCallback cycle = period > 0 ? digital_counter : NULL;
+    uint64_t last;
+    int window, result = 0;
+
+    /* Window -1, if present, is the warm-up */
+    for (window = options.warmup > 0 ? -1 : 0;
+         window < options_get_windows(&options); ++window) {
+        if (! report_begin_window(&fieldbus.report, &options, window)) {
+            result = 2;
+            break;
         }
-        if (! silent) {
-            fieldbus_dump(&fieldbus);
+        last = fieldbus.iteration + (window < 0 ? options.warmup :
+                                     options_get_iterations(&options, period));
+
+        info("Starting loop cycle with %ld us period\n", period);
+        while (fieldbus.iteration < last) {
+            status = fieldbus_iterate(&fieldbus, cycle);
+            if (status < 0) {
+                ++fieldbus.report.errors;
+                info("\nIteration error: status %d\n", status);
+                continue;
+            }
+            if (! silent) {
+                fieldbus_dump(&fieldbus);
+            }
+            if (fieldbus.domain_state.wc_state != EC_WC_COMPLETE) {
+                ++fieldbus.report.wkc_errors;
+            }
+            if (fieldbus.domain_state.redundancy_active) {
+                ++fieldbus.report.redundancy_active;
+            }
+            report_add(&fieldbus.report, fieldbus.iteration_time);
+            scheduler_wait(&fieldbus.report.scheduler, fieldbus.iteration_time);
         }
-        if (max_time == 0) {
-            min_time = max_time = fieldbus.iteration_time;
-        } else if (fieldbus.iteration_time < min_time) {
-            min_time = fieldbus.iteration_time;
-        } else if (fieldbus.iteration_time > max_time) {
-            max_time = fieldbus.iteration_time;
+
+        if (! report_end_window(&fieldbus.report, &options)) {
+            result = 3;
         }
-        total_time += fieldbus.iteration_time;
-        wait_next_iteration(fieldbus.iteration_time, period);
     }
 
+    /* The master completes the pending SDO transfer, if any,
+     * only while the process data are exchanged */
+    mailbox_halt(&fieldbus.mailbox);
+    while (mailbox_is_busy(&fieldbus.mailbox)) {
+        fieldbus_iterate(&fieldbus, NULL);
+        usleep(500);
+    }
+    mailbox_stop(&fieldbus.mailbox);
+
     /* Receive the last packet */
     fieldbus_receive(&fieldbus);
 
-    info("\nIteration time (usec): min %" PRId64 "  max %" PRId64 "  total %" PRId64 "  errors %d\n",
-         min_time, max_time, total_time, errors);
     fieldbus_stop(&fieldbus);
+    capture_stop(&fieldbus.capture);
 
-    return 0;
+    return result;
 }
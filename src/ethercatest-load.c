@@ -0,0 +1,349 @@
+/* ethercatest-load: controlled interference generator
+ * Copyright (C) 2025  Fontana Nicola <ntd at entidi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#define _GNU_SOURCE
+#include "ethercatest.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#define MAX_CPUS    256
+
+typedef void *(*WorkerFunc)(void *);
+
+typedef struct {
+    size_t      line;
+    int         ncpu;
+    int         memory;
+    int         cache;
+    int         disk;
+    size_t      size;
+    const char *dir;
+    const char *flood;
+    int         ncpus;
+    int         cpus[MAX_CPUS];
+    int         nworkers;
+} Load;
+
+
+static void *
+cpu_worker(void *data)
+{
+    volatile uint64_t counter = 0;
+
+    (void) data;
+
+    for (;;) {
+        ++counter;
+    }
+
+    return NULL;
+}
+
+/* Stream big buffers back and forth, to saturate the memory bandwidth */
+static void *
+memory_worker(void *data)
+{
+    Load *load = data;
+    size_t half = load->size / 2;
+    char *buffer = malloc(load->size);
+
+    if (buffer == NULL) {
+        info("Unable to allocate %zu bytes for a memory worker\n", load->size);
+        return NULL;
+    }
+    memset(buffer, 1, load->size);
+
+    for (;;) {
+        memcpy(buffer, buffer + half, half);
+        memcpy(buffer + half, buffer, half);
+    }
+
+    return NULL;
+}
+
+/* Touch cache lines in a pseudo-random order, to defeat the
+ * prefetcher and continuously evict the cache content */
+static void *
+cache_worker(void *data)
+{
+    Load *load = data;
+    size_t nlines = load->size / load->line;
+    volatile char *buffer = malloc(load->size);
+    uint64_t seed = (uintptr_t) &nlines;
+
+    if (buffer == NULL || nlines == 0) {
+        info("Unable to allocate %zu bytes for a cache worker\n", load->size);
+        return NULL;
+    }
+
+    for (;;) {
+        /* xorshift64 */
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+        ++buffer[(seed % nlines) * load->line];
+    }
+
+    return NULL;
+}
+
+/* Small synchronous writes: every fsync() hits the block layer
+ * and the storage interrupts */
+static void *
+disk_worker(void *data)
+{
+    Load *load = data;
+    char path[4096], block[4096];
+    int fd;
+
+    snprintf(path, sizeof(path), "%s/ethercatest-load-XXXXXX", load->dir);
+    fd = mkstemp(path);
+    if (fd < 0) {
+        info("Unable to create a file in '%s': %s\n", load->dir, strerror(errno));
+        return NULL;
+    }
+    /* The file is removed as soon as the process exits */
+    unlink(path);
+    memset(block, 0x55, sizeof(block));
+
+    for (;;) {
+        if (pwrite(fd, block, sizeof(block), 0) < 0 || fsync(fd) < 0) {
+            info("Disk worker failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+/* Send broadcast frames on an interface as fast as possible. When
+ * used on a veth sibling of the EtherCAT one, this generates softirq
+ * load on the same path used by the stack under test. */
+static void *
+flood_worker(void *data)
+{
+    Load *load = data;
+    struct sockaddr_ll addr;
+    unsigned char frame[ETH_FRAME_LEN];
+    struct ether_header *header = (struct ether_header *) frame;
+    int fd;
+
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (fd < 0) {
+        info("Unable to open a raw socket: %s\n", strerror(errno));
+        return NULL;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_ifindex = if_nametoindex(load->flood);
+    addr.sll_halen = ETH_ALEN;
+    memset(addr.sll_addr, 0xFF, ETH_ALEN);
+    if (addr.sll_ifindex == 0) {
+        info("Invalid flood interface '%s'\n", load->flood);
+        close(fd);
+        return NULL;
+    }
+
+    memset(frame, 0, sizeof(frame));
+    memset(header->ether_dhost, 0xFF, ETH_ALEN);
+    header->ether_shost[0] = 0x02;
+    /* IEEE 802 local experimental ethertype */
+    header->ether_type = htons(0x88B5);
+
+    for (;;) {
+        if (sendto(fd, frame, sizeof(frame), 0,
+                   (struct sockaddr *) &addr, sizeof(addr)) < 0 &&
+            errno != ENOBUFS) {
+            info("Flood worker failed: %s\n", strerror(errno));
+            break;
+        }
+    }
+
+    close(fd);
+    return NULL;
+}
+
+static int
+spawn(Load *load, WorkerFunc func, int count)
+{
+    pthread_t thread;
+    cpu_set_t set;
+    int n, cpu;
+
+    for (n = 0; n < count; ++n) {
+        if (pthread_create(&thread, NULL, func, load) != 0) {
+            info("Unable to create worker %d\n", load->nworkers);
+            return FALSE;
+        }
+        if (load->ncpus > 0) {
+            cpu = load->cpus[load->nworkers % load->ncpus];
+            CPU_ZERO(&set);
+            CPU_SET(cpu, &set);
+            if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+                info("Unable to pin worker %d to CPU %d\n", load->nworkers, cpu);
+                return FALSE;
+            }
+        }
+        pthread_detach(thread);
+        ++load->nworkers;
+    }
+
+    return TRUE;
+}
+
+/* Parse a CPU list in the kernel format (e.g. "0,2-3") */
+static int
+parse_cpus(Load *load, const char *text)
+{
+    char *endptr;
+    long first, last;
+
+    load->ncpus = 0;
+    while (*text != '\0') {
+        first = last = strtol(text, &endptr, 10);
+        if (*endptr == '-') {
+            text = endptr + 1;
+            last = strtol(text, &endptr, 10);
+        }
+        if (endptr == text || first < 0 || last < first ||
+            (*endptr != '\0' && *endptr != ',')) {
+            return FALSE;
+        }
+        for (; first <= last && load->ncpus < MAX_CPUS; ++first) {
+            load->cpus[load->ncpus++] = first;
+        }
+        text = *endptr == ',' ? endptr + 1 : endptr;
+    }
+
+    return load->ncpus > 0;
+}
+
+static void
+usage(void)
+{
+    info("Usage: ethercatest-load [OPTIONS]\n"
+         "  -c, --cpu N        Busy loop workers\n"
+         "  -m, --memory N     Memory bandwidth workers (streaming copies)\n"
+         "  -C, --cache N      Cache thrashing workers (random accesses)\n"
+         "  -d, --disk N       Synchronous I/O workers (write + fsync)\n"
+         "  -f, --flood IFACE  Flood IFACE with broadcast frames\n"
+         "  -s, --size KIB     Buffer size of memory and cache workers (default 65536)\n"
+         "  -D, --dir DIR      Where to create the files for disk workers (default /tmp)\n"
+         "  -p, --pin CPUS     Pin the workers round robin on CPUS (e.g. '0,2-3')\n"
+         "  -t, --time SECONDS Stop after SECONDS (default: run until killed)\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    Load load;
+    const char *arg, *value;
+    char *endptr;
+    long number, seconds;
+    int64_t line;
+    int n;
+
+    setbuf(stdout, NULL);
+
+    memset(&load, 0, sizeof(load));
+    load.size = 65536 * 1024;
+    /* Touching one byte per cache line is enough to evict it */
+    line = get_cache_line();
+    load.line = line > 0 ? (size_t) line : 64;
+    load.dir = "/tmp";
+    seconds = 0;
+
+    for (n = 1; n < argc; ++n) {
+        arg = argv[n];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage();
+            return 0;
+        }
+        if (n + 1 >= argc) {
+            info("Invalid arguments.\n");
+            usage();
+            return 1;
+        }
+
+        value = argv[++n];
+        number = strtol(value, &endptr, 10);
+        if (strcmp(arg, "-f") == 0 || strcmp(arg, "--flood") == 0) {
+            load.flood = value;
+        } else if (strcmp(arg, "-D") == 0 || strcmp(arg, "--dir") == 0) {
+            load.dir = value;
+        } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--pin") == 0) {
+            if (! parse_cpus(&load, value)) {
+                info("Invalid CPU list '%s'\n", value);
+                return 1;
+            }
+        } else if (*endptr != '\0' || number < 0) {
+            info("Invalid value '%s' for '%s'\n", value, arg);
+            return 1;
+        } else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--cpu") == 0) {
+            load.ncpu = number;
+        } else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--memory") == 0) {
+            load.memory = number;
+        } else if (strcmp(arg, "-C") == 0 || strcmp(arg, "--cache") == 0) {
+            load.cache = number;
+        } else if (strcmp(arg, "-d") == 0 || strcmp(arg, "--disk") == 0) {
+            load.disk = number;
+        } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--size") == 0) {
+            if (number == 0) {
+                info("Invalid value '%s' for '%s'\n", value, arg);
+                return 1;
+            }
+            load.size = (size_t) number * 1024;
+        } else if (strcmp(arg, "-t") == 0 || strcmp(arg, "--time") == 0) {
+            seconds = number;
+        } else {
+            info("Invalid option '%s'\n", arg);
+            usage();
+            return 1;
+        }
+    }
+
+    if (! spawn(&load, cpu_worker, load.ncpu) ||
+        ! spawn(&load, memory_worker, load.memory) ||
+        ! spawn(&load, cache_worker, load.cache) ||
+        ! spawn(&load, disk_worker, load.disk) ||
+        ! spawn(&load, flood_worker, load.flood != NULL ? 1 : 0)) {
+        return 2;
+    }
+    info("%d workers started\n", load.nworkers);
+
+    if (seconds > 0) {
+        sleep(seconds);
+    } else {
+        for (;;) {
+            pause();
+        }
+    }
+
+    return 0;
+}
@@ -0,0 +1,489 @@
+/* ethercatest-replay: answer EtherCAT frames with a captured session
+ * Copyright (C) 2025  Fontana Nicola <ntd at entidi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ethercatest.h"
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <linux/if_packet.h>
+#include <net/ethernet.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#define ECAT_HEADER_SIZE    2
+#define DATAGRAM_HEADER_SIZE 10
+#define DATAGRAM_MORE       0x8000
+/* How many recorded requests to look ahead when resyncing */
+#define RESYNC_WINDOW       64
+
+typedef struct {
+    uint8_t *       data;
+    size_t          size;
+    /* Capture time, in nanoseconds */
+    uint64_t        time;
+    int             outbound;
+} Frame;
+
+/* A recorded request with the response that came back for it */
+typedef struct {
+    const Frame *   request;
+    const Frame *   response;
+} Exchange;
+
+typedef struct {
+    Frame *         frames;
+    size_t          nframes;
+    Exchange *      exchanges;
+    size_t          nexchanges;
+    size_t          next;
+    int             loop;
+    int             timing;
+    uint64_t        answered;
+    uint64_t        resynced;
+    uint64_t        unmatched;
+} Replay;
+
+static volatile sig_atomic_t quit = FALSE;
+
+
+static void
+on_signal(int signum)
+{
+    (void) signum;
+    quit = TRUE;
+}
+
+static uint32_t
+get_u32(const uint8_t *data)
+{
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static uint16_t
+get_le16(const uint8_t *data)
+{
+    return data[0] | (data[1] << 8);
+}
+
+/* Load all the enhanced packet blocks of `path`. Only the files written
+ * by the test programs (single interface, host byte order) are
+ * supported. */
+static int
+replay_load(Replay *replay, const char *path)
+{
+    FILE *file;
+    uint8_t header[8], *block;
+    uint32_t type, size, offset;
+    uint64_t scale = 1000;
+    size_t allocated = 0;
+    Frame *frame;
+    int result = FALSE;
+
+    file = fopen(path, "rb");
+    if (file == NULL) {
+        info("Unable to open '%s': %s\n", path, strerror(errno));
+        return FALSE;
+    }
+
+    while (fread(header, sizeof(header), 1, file) == 1) {
+        type = get_u32(header);
+        size = get_u32(header + 4);
+        if (size < 12 || (size & 3) != 0) {
+            info("Invalid block in '%s'\n", path);
+            goto out;
+        }
+        block = malloc(size - 8);
+        if (block == NULL || fread(block, size - 8, 1, file) != 1) {
+            free(block);
+            info("Truncated block in '%s'\n", path);
+            goto out;
+        }
+
+        if (type == PCAPNG_SHB && get_u32(block) != PCAPNG_BYTE_ORDER) {
+            info("'%s' has a different byte order: not supported\n", path);
+            free(block);
+            goto out;
+        } else if (type == PCAPNG_IDB) {
+            /* Default resolution is usec: look for if_tsresol */
+            for (offset = 8; offset + 4 <= size - 12; ) {
+                uint16_t code = block[offset] | (block[offset + 1] << 8);
+                uint16_t len = block[offset + 2] | (block[offset + 3] << 8);
+                if (code == PCAPNG_OPT_END || offset + 4 + len > size - 12) {
+                    break;
+                }
+                if (code == PCAPNG_IF_TSRESOL && len == 1 && block[offset + 4] <= 9) {
+                    unsigned digits;
+                    scale = 1;
+                    for (digits = block[offset + 4]; digits < 9; ++digits) {
+                        scale *= 10;
+                    }
+                }
+                offset += 4 + ((len + 3) & ~3);
+            }
+        } else if (type == PCAPNG_EPB && size >= 32) {
+            uint32_t captured = get_u32(block + 12);
+            /* Compare before any arithmetic on a value read from the
+             * file, that could wrap around */
+            if (captured > size - 32) {
+                free(block);
+                info("Invalid packet block in '%s'\n", path);
+                goto out;
+            }
+            if (replay->nframes == allocated) {
+                allocated = allocated > 0 ? allocated * 2 : 1024;
+                frame = realloc(replay->frames, allocated * sizeof(Frame));
+                if (frame == NULL) {
+                    free(block);
+                    goto out;
+                }
+                replay->frames = frame;
+            }
+            frame = replay->frames + replay->nframes;
+            frame->time = (((uint64_t) get_u32(block + 4) << 32) | get_u32(block + 8)) * scale;
+            frame->size = captured;
+            frame->data = malloc(captured);
+            if (frame->data == NULL) {
+                free(block);
+                goto out;
+            }
+            memcpy(frame->data, block + 20, captured);
+            frame->outbound = FALSE;
+            for (offset = 20 + ((captured + 3) & ~3); offset + 4 <= size - 12; ) {
+                uint16_t code = block[offset] | (block[offset + 1] << 8);
+                uint16_t len = block[offset + 2] | (block[offset + 3] << 8);
+                if (code == PCAPNG_OPT_END || offset + 4 + len > size - 12) {
+                    break;
+                }
+                if (code == PCAPNG_EPB_FLAGS && len == 4) {
+                    frame->outbound = (get_u32(block + offset + 4) & 3) == 2;
+                }
+                offset += 4 + ((len + 3) & ~3);
+            }
+            ++replay->nframes;
+        }
+        free(block);
+    }
+    result = TRUE;
+
+out:
+    fclose(file);
+    return result;
+}
+
+/* Size of a frame up to the end of its EtherCAT payload, 0 if invalid.
+ * The frames shorter than ETH_ZLEN are captured unpadded when sent but
+ * padded when received, so the Ethernet size cannot be compared */
+static size_t
+ecat_size(const uint8_t *data, size_t size)
+{
+    size_t ecat;
+
+    if (size < ETH_HLEN + ECAT_HEADER_SIZE) {
+        return 0;
+    }
+    ecat = ETH_HLEN + ECAT_HEADER_SIZE + (get_le16(data + ETH_HLEN) & 0x07FF);
+    return ecat <= size ? ecat : 0;
+}
+
+/* Get the first datagram index of an EtherCAT frame, -1 if invalid */
+static int
+frame_index(const uint8_t *data, size_t size)
+{
+    if (size < ETH_HLEN + ECAT_HEADER_SIZE + DATAGRAM_HEADER_SIZE) {
+        return -1;
+    }
+    return data[ETH_HLEN + ECAT_HEADER_SIZE + 1];
+}
+
+/* Pair every outbound frame with the first inbound frame carrying the
+ * same datagram (command and index) and EtherCAT payload size: on a
+ * ring the frame comes back modified */
+static int
+replay_pair(Replay *replay)
+{
+    const Frame *request, *response;
+    size_t n, m, size;
+    int index;
+
+    replay->exchanges = calloc(replay->nframes, sizeof(Exchange));
+    if (replay->exchanges == NULL && replay->nframes > 0) {
+        return FALSE;
+    }
+
+    for (n = 0; n < replay->nframes; ++n) {
+        request = replay->frames + n;
+        index = frame_index(request->data, request->size);
+        size = ecat_size(request->data, request->size);
+        if (! request->outbound || index < 0 || size == 0) {
+            continue;
+        }
+        for (m = n + 1; m < replay->nframes && m < n + RESYNC_WINDOW; ++m) {
+            response = replay->frames + m;
+            if (! response->outbound && response->size <= ETH_FRAME_LEN &&
+                ecat_size(response->data, response->size) == size &&
+                frame_index(response->data, response->size) == index &&
+                response->data[ETH_HLEN + ECAT_HEADER_SIZE] ==
+                request->data[ETH_HLEN + ECAT_HEADER_SIZE]) {
+                replay->exchanges[replay->nexchanges].request = request;
+                replay->exchanges[replay->nexchanges].response = response;
+                ++replay->nexchanges;
+                break;
+            }
+        }
+    }
+
+    return TRUE;
+}
+
+/* Two requests match if they have the same datagrams (command, address
+ * and length), regardless of the indexes and of the data */
+static int
+requests_match(const uint8_t *a, const uint8_t *b, size_t size)
+{
+    size_t offset = ETH_HLEN + ECAT_HEADER_SIZE;
+    uint16_t len;
+
+    while (offset + DATAGRAM_HEADER_SIZE <= size) {
+        if (a[offset] != b[offset] ||
+            memcmp(a + offset + 2, b + offset + 2, 6) != 0) {
+            return FALSE;
+        }
+        len = get_le16(a + offset + 6);
+        offset += DATAGRAM_HEADER_SIZE + (len & 0x07FF) + 2;
+        if ((len & DATAGRAM_MORE) == 0) {
+            break;
+        }
+    }
+    return TRUE;
+}
+
+/* Find the recorded exchange for `request`, whose EtherCAT payload
+ * ends at `size`: the next one or, if it does not match, the first
+ * matching one in the following ones */
+static const Exchange *
+replay_find(Replay *replay, const uint8_t *request, size_t size)
+{
+    const Exchange *exchange;
+    size_t n, i;
+
+    for (n = 0; n < RESYNC_WINDOW && n < replay->nexchanges; ++n) {
+        i = replay->next + n;
+        if (i >= replay->nexchanges) {
+            if (! replay->loop) {
+                break;
+            }
+            i %= replay->nexchanges;
+        }
+        exchange = replay->exchanges + i;
+        if (ecat_size(exchange->request->data, exchange->request->size) == size &&
+            requests_match(exchange->request->data, request, size)) {
+            if (n > 0) {
+                ++replay->resynced;
+            }
+            replay->next = i + 1;
+            if (replay->loop && replay->next >= replay->nexchanges) {
+                replay->next = 0;
+            }
+            return exchange;
+        }
+    }
+
+    ++replay->unmatched;
+    return NULL;
+}
+
+/* Copy the datagram indexes of `request` into `response` */
+static void
+patch_indexes(uint8_t *response, const uint8_t *request, size_t size)
+{
+    size_t offset = ETH_HLEN + ECAT_HEADER_SIZE;
+    uint16_t len;
+
+    while (offset + DATAGRAM_HEADER_SIZE <= size) {
+        response[offset + 1] = request[offset + 1];
+        len = get_le16(request + offset + 6);
+        offset += DATAGRAM_HEADER_SIZE + (len & 0x07FF) + 2;
+        if ((len & DATAGRAM_MORE) == 0) {
+            break;
+        }
+    }
+}
+
+static int
+replay_run(Replay *replay, const char *iface)
+{
+    struct sockaddr_ll addr;
+    socklen_t addr_size;
+    uint8_t request[ETH_FRAME_LEN + 4], response[ETH_FRAME_LEN + 4];
+    const Exchange *exchange;
+    struct timespec ts;
+    uint64_t delay;
+    ssize_t size;
+    size_t ecat;
+    int fd;
+
+    fd = socket(AF_PACKET, SOCK_RAW, htons(ETHERCAT_ETHERTYPE));
+    if (fd < 0) {
+        info("Unable to open a raw socket: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETHERCAT_ETHERTYPE);
+    addr.sll_ifindex = if_nametoindex(iface);
+    if (addr.sll_ifindex == 0 ||
+        bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        info("Unable to bind to '%s'\n", iface);
+        close(fd);
+        return FALSE;
+    }
+
+    info("Replaying %zu exchanges on '%s'\n", replay->nexchanges, iface);
+    while (! quit) {
+        addr_size = sizeof(addr);
+        size = recvfrom(fd, request, sizeof(request), 0,
+                        (struct sockaddr *) &addr, &addr_size);
+        if (size < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            info("Receive failed: %s\n", strerror(errno));
+            break;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        /* Skip our own responses */
+        if (addr.sll_pkttype == PACKET_OUTGOING) {
+            continue;
+        }
+
+        ecat = ecat_size(request, size);
+        exchange = replay_find(replay, request, ecat);
+        if (exchange == NULL) {
+            if (! replay->loop && replay->next >= replay->nexchanges) {
+                info("End of the recorded session\n");
+                break;
+            }
+            continue;
+        }
+
+        /* The recorded response, padded or not, carries the same
+         * datagrams of the request */
+        size = exchange->response->size;
+        memcpy(response, exchange->response->data, size);
+        patch_indexes(response, request, ecat);
+
+        if (replay->timing) {
+            /* Reproduce the recorded roundtrip */
+            delay = exchange->response->time - exchange->request->time;
+            ts.tv_sec += delay / 1000000000;
+            ts.tv_nsec += delay % 1000000000;
+            if (ts.tv_nsec >= 1000000000) {
+                ++ts.tv_sec;
+                ts.tv_nsec -= 1000000000;
+            }
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR && ! quit)
+                ;
+        }
+
+        if (send(fd, response, size, 0) < 0) {
+            info("Send failed: %s\n", strerror(errno));
+            break;
+        }
+        ++replay->answered;
+    }
+
+    close(fd);
+    info("%" PRIu64 " frames answered, %" PRIu64 " after a resync, %" PRIu64 " unmatched\n",
+         replay->answered, replay->resynced, replay->unmatched);
+    return TRUE;
+}
+
+static void
+usage(void)
+{
+    info("Usage: ethercatest-replay [-l|--loop] [-n|--no-timing] FILE IFACE\n"
+         "  FILE  pcapng file saved with `--capture`\n"
+         "  IFACE Interface where to answer (e.g. the peer of the veth\n"
+         "        used by the test program)\n"
+         "  -l, --loop       Restart from the beginning at the end of FILE\n"
+         "  -n, --no-timing  Answer immediately, instead of reproducing\n"
+         "                   the recorded roundtrip\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    Replay replay;
+    struct sigaction action;
+    const char *path, *iface, *arg;
+    int n;
+
+    setbuf(stdout, NULL);
+
+    memset(&replay, 0, sizeof(replay));
+    replay.timing = TRUE;
+    path = iface = NULL;
+
+    for (n = 1; n < argc; ++n) {
+        arg = argv[n];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage();
+            return 0;
+        } else if (strcmp(arg, "-l") == 0 || strcmp(arg, "--loop") == 0) {
+            replay.loop = TRUE;
+        } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--no-timing") == 0) {
+            replay.timing = FALSE;
+        } else if (path == NULL) {
+            path = arg;
+        } else if (iface == NULL) {
+            iface = arg;
+        } else {
+            info("Invalid arguments.\n");
+            usage();
+            return 1;
+        }
+    }
+    if (path == NULL || iface == NULL) {
+        usage();
+        return 1;
+    }
+
+    if (! replay_load(&replay, path) || ! replay_pair(&replay)) {
+        return 2;
+    }
+    if (replay.nexchanges == 0) {
+        info("No request/response pairs found in '%s'\n", path);
+        return 2;
+    }
+
+    /* No SA_RESTART, so a blocking recvfrom() can be interrupted */
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_signal;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    return replay_run(&replay, iface) ? 0 : 2;
+}
@@ -28,11 +28,18 @@
 typedef struct {
     ecx_contextt context;
     const char *iface;
+    /* Secondary interface for cable redundancy, if any */
+    const char *iface2;
+    ecx_redportt redport;
     uint8 group;
     int wkc;
     uint64_t iteration;
     int64_t iteration_time;
     uint8 map[4096];
+    Report report;
+    Mailbox mailbox;
+    Capture capture;
+    uint16 sdo_slave;
 } Fieldbus;
 
 typedef void (*FieldbusCallback)(Fieldbus *);
@@ -45,6 +52,7 @@ fieldbus_initialize(Fieldbus *self)
     memset(self, 0, sizeof(*self));
 
     self->iface = NULL;
+    self->iface2 = NULL;
     self->group = 0;
     self->wkc = 0;
     self->iteration = 0;
@@ -67,6 +75,7 @@ fieldbus_receive(Fieldbus *self)
 static int
 fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
 {
+    Reaction *reaction = &self->report.reaction;
     int64_t start, stop;
     int status;
 
@@ -75,6 +84,16 @@ fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
     if (! fieldbus_receive(self)) {
         return 0;
     }
+    if (reaction->send_ahead) {
+        /* Refresh the inputs: ecx_receive_processdata() blocks
+         * until the frame is back, so no need to wait for it */
+        if (! fieldbus_send(self)) {
+            return 0;
+        }
+        reaction_sent(reaction, get_monotonic_time(), FALSE);
+        fieldbus_receive(self);
+        reaction_received(reaction, get_monotonic_time(), self->wkc > 0);
+    }
     if (callback != NULL) {
         callback(self);
     }
@@ -83,6 +102,7 @@ fieldbus_iterate(Fieldbus *self, FieldbusCallback callback)
     }
 
     stop = get_monotonic_time();
+    reaction_sent(reaction, stop, TRUE);
 
     ++self->iteration;
     self->iteration_time = stop - start;
@@ -105,12 +125,26 @@ fieldbus_start(Fieldbus *self)
     context = &self->context;
     grp = context->grouplist + self->group;
 
-    info("Initializing SOEM on '%s'... ", self->iface);
-    if (! ecx_init(context, self->iface)) {
-        info("no socket connection\n");
-        return FALSE;
+    if (self->iface2 == NULL) {
+        info("Initializing SOEM on '%s'... ", self->iface);
+        if (! ecx_init(context, self->iface)) {
+            info("no socket connection\n");
+            return FALSE;
+        }
+    } else {
+        /* Frames are sent on both interfaces: when the ring is broken,
+         * every part of the network is still reached from one side */
+        info("Initializing SOEM on '%s' and '%s' (redundant)... ",
+             self->iface, self->iface2);
+        if (! ecx_init_redundant(context, &self->redport, self->iface,
+                                 (char *) self->iface2)) {
+            info("no socket connection\n");
+            return FALSE;
+        }
+        self->report.links = 2;
     }
     info("done\n");
+    report_phase(&self->report, "init");
 
     info("Finding autoconfig slaves... ");
     if (ecx_config_init(context) <= 0) {
@@ -118,6 +152,7 @@ fieldbus_start(Fieldbus *self)
         return FALSE;
     }
     info("%d slaves found\n", context->slavecount);
+    report_phase(&self->report, "config");
 
     info("Sequential mapping of I/O... ");
     ecx_config_map_group(context, self->map, self->group);
@@ -131,14 +166,17 @@ fieldbus_start(Fieldbus *self)
         info(" slaves)");
     }
     info("\n");
+    report_phase(&self->report, "mapping");
 
     info("Configuring distributed clock... ");
     ecx_configdc(context);
     info("done\n");
+    report_phase(&self->report, "dc");
 
     info("Waiting for all slaves in safe operational... ");
     ecx_statecheck(context, 0, EC_STATE_SAFE_OP, EC_TIMEOUTSTATE * 4);
     info("done\n");
+    report_phase(&self->report, "safeop");
 
     info("Initial process data transmission... ");
     ecx_send_processdata(context);
@@ -156,6 +194,7 @@ fieldbus_start(Fieldbus *self)
         ecx_statecheck(context, 0, EC_STATE_OPERATIONAL, EC_TIMEOUTSTATE / 10);
         if (slave->state == EC_STATE_OPERATIONAL) {
             info(" all slaves are now operational\n");
+            report_phase(&self->report, "op");
             return TRUE;
         }
     }
@@ -249,6 +288,13 @@ fieldbus_recover(Fieldbus *self)
     }
 }
 
+static int
+fieldbus_expected_wkc(Fieldbus *self)
+{
+    ec_groupt *grp = self->context.grouplist + self->group;
+    return grp->outputsWKC * 2 + grp->inputsWKC;
+}
+
 static void
 fieldbus_dump(Fieldbus *self)
 {
@@ -260,9 +306,9 @@ fieldbus_dump(Fieldbus *self)
     context = &self->context;
     grp = context->grouplist + self->group;
 
-    expected_wkc = grp->outputsWKC * 2 + grp->inputsWKC;
-    info("Iteration %" PRIu64 ":  %" PRId64 " usec  WKC %d",
-         self->iteration, self->iteration_time, self->wkc);
+    expected_wkc = fieldbus_expected_wkc(self);
+    info("Iteration %" PRIu64 ":  %.3f usec  WKC %d",
+         self->iteration, USEC(self->iteration_time), self->wkc);
     if (self->wkc != expected_wkc) {
         info(" wrong (expected %d)\n", expected_wkc);
     }
@@ -278,6 +324,41 @@ fieldbus_dump(Fieldbus *self)
     info("  T: %lld\r", (long long) context->DCtime);
 }
 
+static int
+fieldbus_sdo_transaction(void *data, const Options *options)
+{
+    Fieldbus *self = data;
+    ecx_contextt *context = &self->context;
+    uint8 buffer[64];
+    int n, size;
+
+    /* Round robin on the slaves supporting CoE */
+    for (n = 0; n < context->slavecount; ++n) {
+        self->sdo_slave = self->sdo_slave % context->slavecount + 1;
+        if (context->slavelist[self->sdo_slave].mbx_proto & ECT_MBXPROT_COE) {
+            break;
+        }
+    }
+    if (n >= context->slavecount) {
+        return FALSE;
+    }
+
+    size = sizeof(buffer);
+    if (ecx_SDOread(context, self->sdo_slave,
+                    options->sdo_index, options->sdo_subindex, FALSE,
+                    &size, buffer, EC_TIMEOUTRXM) <= 0) {
+        return FALSE;
+    }
+    if (options->sdo_write &&
+        ecx_SDOwrite(context, self->sdo_slave,
+                     options->sdo_index, options->sdo_subindex, FALSE,
+                     size, buffer, EC_TIMEOUTRXM) <= 0) {
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
 static void
 digital_counter(Fieldbus *self)
 {
@@ -289,22 +370,27 @@ digital_counter(Fieldbus *self)
 static void
 usage(void)
 {
-    info("Usage: ethercatest-soem [-q|--quiet] [INTERFACE] [PERIOD]\n"
+    info("Usage: ethercatest-soem [-q|--quiet] [-r|--redundant INTERFACE2] [OPTIONS] [INTERFACE] [PERIOD]\n"
          "  [INTERFACE] Ethernet device to use (e.g. 'eth0')\n"
-         "  [PERIOD]    Scantime in us (0 for roundtrip performances)\n");
+         "  [PERIOD]    Scantime in us (0 for roundtrip performances)\n"
+         "  -r, --redundant INTERFACE2  Secondary Ethernet device, connected\n"
+         "                              to the other end of the ring\n");
+    options_usage();
 }
 
 int
 main(int argc, char *argv[])
 {
     Fieldbus fieldbus;
+    Options options;
     const char *iface, *arg;
     long period;
-    int n, silent;
+    int n, silent, status;
 
     setbuf(stdout, NULL);
 
     fieldbus_initialize(&fieldbus);
+    options_initialize(&options);
 
     /* Parse arguments */
     iface = NULL;
@@ -318,6 +404,17 @@ main(int argc, char *argv[])
             return 0;
         } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
             silent = 1;
+        } else if (strcmp(arg, "-r") == 0 || strcmp(arg, "--redundant") == 0) {
+            if (n + 1 >= argc) {
+                usage();
+                return 1;
+            }
+            fieldbus.iface2 = argv[++n];
+        } else if ((status = options_parse(&options, argc, argv, &n)) != 0) {
+            if (status < 0) {
+                usage();
+                return 1;
+            }
         } else if (arg[0] != '\0') {
             char *endptr;
             long value = strtol(arg, &endptr, 10);
@@ -333,41 +430,74 @@ main(int argc, char *argv[])
         }
     }
 
+    if (! report_initialize(&fieldbus.report, "soem", &options)) {
+        return 2;
+    }
+    fieldbus.report.period = period;
     fieldbus.iface = iface == NULL ? get_default_interface() : iface;
+    if (! nic_setup(&fieldbus.report.nic, fieldbus.iface, &options)) {
+        return 2;
+    }
+    nic_dump(&fieldbus.report.nic);
+    /* Only the settings of the primary interface are recorded */
+    if (fieldbus.iface2 != NULL && options.nic_profile != NULL &&
+        ! nic_apply_profile(fieldbus.iface2, options.nic_profile)) {
+        return 2;
+    }
+    report_phase(&fieldbus.report, "nic");
+
+    if (! capture_start(&fieldbus.capture, fieldbus.iface, options.capture)) {
+        return 2;
+    }
+
     if (! fieldbus_start(&fieldbus)) {
         return 2;
     }
 
-    int64_t min_time = 0;
-    int64_t max_time = 0;
-    int64_t total_time = 0;
-    int errors = 0;
-    uint64_t iterations = 100000 / (period / 100 + 3);
-    FieldbusCallback cycle = period > 0 ? digital_counter : NULL;
+    if (! mailbox_start(&fieldbus.mailbox, fieldbus_sdo_transaction, &fieldbus, &options)) {
+        fieldbus_stop(&fieldbus);
+        return 2;
+    }
+    fieldbus.report.mailbox = &fieldbus.mailbox;
 
-    info("Starting loop cycle with %ld us period\n", period);
-    while (fieldbus.iteration < iterations) {
-        if (! fieldbus_iterate(&fieldbus, cycle)) {
-            ++errors;
-            info("\nIteration error\n");
-            continue;
+    FieldbusCallback cycle = period > 0 ? digital_counter : NULL;
+    uint64_t last;
+    int window, result = 0;
+
+    /* Window -1, if present, is the warm-up */
+    for (window = options.warmup > 0 ? -1 : 0;
+         window < options_get_windows(&options); ++window) {
+        if (! report_begin_window(&fieldbus.report, &options, window)) {
+            result = 2;
+            break;
         }
-        if (! silent) {
-            fieldbus_dump(&fieldbus);
+        last = fieldbus.iteration + (window < 0 ? options.warmup :
+                                     options_get_iterations(&options, period));
+
+        info("Starting loop cycle with %ld us period\n", period);
+        while (fieldbus.iteration < last) {
+            if (! fieldbus_iterate(&fieldbus, cycle)) {
+                ++fieldbus.report.errors;
+                info("\nIteration error\n");
+                continue;
+            }
+            if (! silent) {
+                fieldbus_dump(&fieldbus);
+            }
+            if (fieldbus.wkc != fieldbus_expected_wkc(&fieldbus)) {
+                ++fieldbus.report.wkc_errors;
+            }
+            report_add(&fieldbus.report, fieldbus.iteration_time);
+            scheduler_wait(&fieldbus.report.scheduler, fieldbus.iteration_time);
         }
-        if (max_time == 0) {
-            min_time = max_time = fieldbus.iteration_time;
-        } else if (fieldbus.iteration_time < min_time) {
-            min_time = fieldbus.iteration_time;
-        } else if (fieldbus.iteration_time > max_time) {
-            max_time = fieldbus.iteration_time;
+
+        if (! report_end_window(&fieldbus.report, &options)) {
+            result = 3;
         }
-        total_time += fieldbus.iteration_time;
-        wait_next_iteration(fieldbus.iteration_time, period);
     }
-    info("\nIteration time (usec): min %" PRId64 "  max %" PRId64 "  total %" PRId64 "  errors %d\n",
-         min_time, max_time, total_time, errors);
+    mailbox_stop(&fieldbus.mailbox);
     fieldbus_stop(&fieldbus);
+    capture_stop(&fieldbus.capture);
 
-    return 0;
+    return result;
 }
@@ -0,0 +1,180 @@
+/* ethercatest-top: live viewer of the metrics published by the tests
+ * Copyright (C) 2025  Fontana Nicola <ntd at entidi.it>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+#include "ethercatest.h"
+#include <errno.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define HEADER_EVERY    20
+
+
+/* Compute the statistics of the iterations performed between
+ * `previous` and `current`: min and max are not known, so the ones
+ * of the whole window are used to clamp the percentiles */
+static void
+get_interval(Stats *interval, const Stats *previous, const Stats *current)
+{
+    int n;
+
+    memcpy(interval, current, sizeof(*interval));
+    interval->iterations -= previous->iterations;
+    interval->total -= previous->total;
+    for (n = 0; n < STATS_BUCKETS; ++n) {
+        interval->histogram[n] -= previous->histogram[n];
+    }
+}
+
+static void
+dump_header(const Metrics *metrics)
+{
+    info("%s%s%s, %ld us period\n", metrics->stack,
+         metrics->label[0] != '\0' ? " " : "", metrics->label, metrics->period);
+    info("%6s %10s %8s %8s %8s %8s %8s %8s %8s %8s %8s\n",
+         "window", "iterations", "rate", "last", "p50", "p99", "p99.9",
+         "max", "errors", "wkc", "overruns");
+}
+
+static void
+dump_metrics(const Metrics *metrics, const Stats *interval, double seconds)
+{
+    info("%6d %10" PRIu64 " %8.0f %8.1f %8.1f %8.1f %8.1f %8.1f"
+         " %8" PRIu32 " %8" PRIu32 " %8" PRIu64 "\n",
+         metrics->window, metrics->stats.iterations,
+         seconds > 0 ? interval->iterations / seconds : 0., USEC(metrics->last),
+         USEC(stats_percentile(interval, 50)), USEC(stats_percentile(interval, 99)),
+         USEC(stats_percentile(interval, 99.9)), USEC(metrics->stats.max),
+         metrics->errors, metrics->wkc_errors, metrics->overruns);
+}
+
+static void
+usage(void)
+{
+    info("Usage: ethercatest-top [-1|--once] NAME [INTERVAL]\n"
+         "  NAME      Name passed to `--publish` by the test program\n"
+         "  INTERVAL  Refresh interval in ms (default 1000)\n"
+         "  -1, --once  Dump the current metrics and exit\n"
+         "\n"
+         "Percentiles and rate refer to the last interval, the other\n"
+         "values to the whole measurement window. Times are in usec.\n");
+}
+
+int
+main(int argc, char *argv[])
+{
+    const Metrics *metrics;
+    Metrics *previous, *current, *swap;
+    Stats *interval;
+    const char *name, *arg;
+    int64_t last_time, now;
+    long interval_ms;
+    int n, once, lines;
+
+    setbuf(stdout, NULL);
+
+    name = NULL;
+    interval_ms = 1000;
+    once = FALSE;
+
+    for (n = 1; n < argc; ++n) {
+        arg = argv[n];
+        if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            usage();
+            return 0;
+        } else if (strcmp(arg, "-1") == 0 || strcmp(arg, "--once") == 0) {
+            once = TRUE;
+        } else if (name == NULL) {
+            name = arg;
+        } else {
+            char *endptr;
+            interval_ms = strtol(arg, &endptr, 10);
+            if (*endptr != '\0' || interval_ms <= 0) {
+                info("Invalid interval '%s'\n", arg);
+                return 1;
+            }
+        }
+    }
+    if (name == NULL) {
+        usage();
+        return 1;
+    }
+
+    metrics = metrics_open(name, FALSE);
+    if (metrics == NULL) {
+        return 2;
+    }
+
+    /* Too big for the stack: the histograms take ~15 Kb each */
+    previous = calloc(1, sizeof(Metrics));
+    current = calloc(1, sizeof(Metrics));
+    interval = calloc(1, sizeof(Stats));
+    if (previous == NULL || current == NULL || interval == NULL) {
+        return 2;
+    }
+
+    if (! metrics_read(metrics, previous)) {
+        info("No consistent metrics from process %d\n", (int) metrics->pid);
+        return 2;
+    }
+    last_time = get_monotonic_time();
+    if (once) {
+        dump_header(previous);
+        dump_metrics(previous, &previous->stats, 0);
+        return 0;
+    }
+
+    for (lines = 0; ; ++lines) {
+        usleep(interval_ms * 1000);
+        if (! metrics_read(metrics, current)) {
+            if (kill(metrics->pid, 0) != 0 && errno == ESRCH) {
+                info("Process %d terminated\n", (int) metrics->pid);
+                break;
+            }
+            /* Stopped in the middle of an update: try again later */
+            continue;
+        }
+        now = get_monotonic_time();
+
+        if (lines % HEADER_EVERY == 0) {
+            dump_header(current);
+        }
+
+        /* A new window restarts all the counters */
+        if (current->window != previous->window ||
+            current->stats.iterations < previous->stats.iterations) {
+            memset(&previous->stats, 0, sizeof(previous->stats));
+        }
+        get_interval(interval, &previous->stats, &current->stats);
+        dump_metrics(current, interval, (now - last_time) / 1000000000.);
+
+        if (kill(current->pid, 0) != 0 && errno == ESRCH) {
+            info("Process %d terminated\n", (int) current->pid);
+            break;
+        }
+
+        swap = previous;
+        previous = current;
+        current = swap;
+        last_time = now;
+    }
+
+    return 0;
+}
@@ -17,34 +17,359 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#define _GNU_SOURCE
 #include "ethercatest.h"
 #include <ifaddrs.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/ethtool.h>
+#include <linux/filter.h>
+#include <linux/if_packet.h>
+#include <linux/sockios.h>
+#include <arpa/inet.h>
+#include <net/ethernet.h>
+#include <poll.h>
 #include <net/if.h>
 #include <alloca.h>
+#include <malloc.h>
 #include <string.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/utsname.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef __x86_64__
+#include <x86intrin.h>
+#endif
 
 
+/* Named NIC profiles: -1 means "leave this parameter alone" */
+typedef struct {
+    const char *    name;
+    int             usecs;
+    int             frames;
+    int             ring;
+    int             offload;
+} NicProfile;
+
+static const NicProfile nic_profiles[] = {
+    /* Interrupt coalescing and offloads disabled */
+    { "lowlatency",  0,  1, -1,  0 },
+    /* Interrupt coalescing disabled */
+    { "nocoalesce",  0,  1, -1, -1 },
+    /* All offloads (GRO, GSO, TSO, checksumming) disabled */
+    { "nooffload",  -1, -1, -1,  0 },
+    /* Rings shrunk to a minimum: the driver is expected to clamp it */
+    { "minring",    -1, -1, 64, -1 },
+};
+
+/* Calibration rounds and clock reads performed in every round */
+#define PLATFORM_ROUNDS     5
+#define PLATFORM_READS      10000
+/* Time used to calibrate the TSC frequency, in nsec */
+#define PLATFORM_TSC_WINDOW 50000000
+/* Send-ahead: polling interval while waiting for the refresh frame,
+ * margin added to the roundtrip percentile and refresh frames between
+ * two updates of the lead (computing a percentile is not free), in nsec */
+#define REACTION_POLL       5000
+#define REACTION_MARGIN     10000
+#define REACTION_UPDATE     256
+/* Attempts to get a consistent snapshot of the metrics: an update
+ * takes a few usec, so hitting this means the publisher is stuck */
+#define METRICS_READ_RETRIES 10000
+
+static const char *overrun_policies[] = {
+    [OVERRUN_RELATIVE] = "relative",
+    [OVERRUN_SKIP]     = "skip",
+    [OVERRUN_CATCHUP]  = "catchup",
+    [OVERRUN_REALIGN]  = "realign",
+};
+
+static const struct {
+    const char *    name;
+    int             policy;
+} policies[] = {
+    { "other", SCHED_OTHER },
+    { "batch", SCHED_BATCH },
+    { "idle",  SCHED_IDLE },
+    { "fifo",  SCHED_FIFO },
+    { "rr",    SCHED_RR },
+};
+
+
+/* Time source of get_monotonic_time(): CLOCK_MONOTONIC or, if
+ * selected with `--tsc`, the TSC scaled to nsec and anchored to
+ * CLOCK_MONOTONIC when calibrated. The two drift apart by the
+ * calibration error, tens of usec per second: so the TSC is only used
+ * to measure intervals, while the deadlines passed to sleep_until()
+ * are always computed with read_clock(). */
+static struct {
+    int         tsc;
+    uint64_t    tsc_base;
+    int64_t     base;
+    /* nsec = ticks * mult >> 32 */
+    uint64_t    mult;
+} time_source;
+
+static int64_t
+timespec_to_nsec(const struct timespec *ts)
+{
+    return ((int64_t) ts->tv_sec) * 1000000000 + ts->tv_nsec;
+}
+
+static void
+nsec_to_timespec(struct timespec *ts, int64_t nsec)
+{
+    ts->tv_sec = nsec / 1000000000;
+    ts->tv_nsec = nsec % 1000000000;
+}
+
+static int64_t
+read_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return timespec_to_nsec(&ts);
+}
+
+/**
+ * get_monotonic_time:
+ *
+ * Read the time source selected by platform_check().
+ *
+ * Returns: the monotonic time in nsec.
+ */
 int64_t
 get_monotonic_time(void)
+{
+#ifdef __x86_64__
+    if (time_source.tsc) {
+        uint64_t ticks = __rdtsc() - time_source.tsc_base;
+        return time_source.base +
+            (int64_t) (((unsigned __int128) ticks * time_source.mult) >> 32);
+    }
+#endif
+    return read_clock();
+}
+
+/* Sleep until @time, read with read_clock() (not get_monotonic_time()) */
+static void
+sleep_until(int64_t time)
 {
     struct timespec ts;
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (((int64_t) ts.tv_sec) * 1000000) + (ts.tv_nsec / 1000);
+
+    nsec_to_timespec(&ts, time);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+static void
+sleep_for(int64_t duration)
+{
+    struct timespec ts;
+
+    nsec_to_timespec(&ts, duration);
+    while (clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, &ts) == EINTR)
+        ;
+}
+
+/**
+ * scheduler_initialize:
+ * @scheduler: a Scheduler instance
+ * @period:    the period of the slots in nsec (0 to not wait at all)
+ * @policy:    how to handle overruns
+ *
+ * Initialize @scheduler and start the slot grid: the first slot
+ * boundary is one period from now.
+ */
+void
+scheduler_initialize(Scheduler *scheduler, int64_t period, OverrunPolicy policy)
+{
+    memset(scheduler, 0, sizeof(*scheduler));
+    scheduler->period = period;
+    scheduler->policy = policy;
+    scheduler->next = read_clock() + period;
+}
+
+static void
+scheduler_overrun(Scheduler *scheduler, int64_t lateness, int64_t missed)
+{
+    info("\n Time overflow (%.3f usec)\n", USEC(lateness));
+    ++scheduler->overruns;
+    scheduler->missed_slots += missed;
+    if (scheduler->burst == 0) {
+        ++scheduler->bursts;
+    }
+    ++scheduler->burst;
+    if (scheduler->burst > scheduler->longest_burst) {
+        scheduler->longest_burst = scheduler->burst;
+    }
+}
+
+/**
+ * scheduler_wait:
+ * @scheduler:      a Scheduler instance
+ * @iteration_time: time spent by the last iteration, in nsec
+ *
+ * Wait for the start of the next iteration according to the overrun
+ * policy of @scheduler, keeping track of the overruns.
+ */
+void
+scheduler_wait(Scheduler *scheduler, int64_t iteration_time)
+{
+    int64_t period = scheduler->period;
+    int64_t now, first, missed;
+
+    if (period <= 0) {
+        return;
+    }
+
+    if (scheduler->policy == OVERRUN_RELATIVE) {
+        if (iteration_time > period) {
+            scheduler_overrun(scheduler, iteration_time, iteration_time / period);
+        } else {
+            scheduler->burst = 0;
+            sleep_for(period - iteration_time);
+        }
+        return;
+    }
+
+    /* The slot grid is on CLOCK_MONOTONIC, the timeline of the sleeps */
+    now = read_clock();
+    if (now <= scheduler->next) {
+        scheduler->burst = 0;
+        sleep_until(scheduler->next);
+        scheduler->next += period;
+        return;
+    }
+
+    /* Do not count twice the boundaries already missed by a previous
+     * iteration: with catch-up, the late iterations overlap */
+    first = scheduler->next;
+    if (first <= scheduler->last_missed) {
+        first = scheduler->last_missed + period;
+    }
+    missed = 0;
+    if (now >= first) {
+        missed = (now - first) / period + 1;
+        scheduler->last_missed = first + (missed - 1) * period;
+    }
+    scheduler_overrun(scheduler, now - scheduler->next + period, missed);
+
+    switch (scheduler->policy) {
+    case OVERRUN_SKIP:
+        scheduler->next += missed * period;
+        sleep_until(scheduler->next);
+        scheduler->next += period;
+        break;
+    case OVERRUN_CATCHUP:
+        scheduler->next += period;
+        break;
+    default:
+        /* First boundary of the original grid after now */
+        scheduler->next += ((now - scheduler->next) / period + 1) * period;
+        break;
+    }
+}
+
+/**
+ * reaction_sent:
+ * @reaction: a Reaction instance
+ * @time:     when the frame has been sent
+ * @outputs:  TRUE if the frame carries outputs computed from the last
+ *            received inputs, FALSE for send-ahead refresh frames
+ *
+ * Account a frame transmission. In the usual cycle (receive, compute,
+ * send) every frame is an output frame, so the reaction time is the
+ * time between two transmissions, i.e. roughly the period.
+ */
+void
+reaction_sent(Reaction *reaction, int64_t time, int outputs)
+{
+    if (outputs && reaction->last_send > 0) {
+        stats_add(&reaction->time, time - reaction->last_send);
+    }
+    reaction->last_send = time;
+}
+
+/**
+ * reaction_wait:
+ * @reaction: a Reaction instance
+ *
+ * Sleep for a polling step while waiting for the refresh frame, for
+ * stacks that cannot block on the reception: the caller is expected
+ * to check for the frame after every step. The lead is only an upper
+ * bound, so the measured roundtrip is the real one (plus at most a
+ * polling step) and not the lead itself.
+ *
+ * Returns: FALSE if the lead already expired, i.e. the frame is late.
+ */
+int
+reaction_wait(Reaction *reaction)
+{
+    /* `last_send` comes from get_monotonic_time(), so sleep for the
+     * time left instead of until a deadline on a different timeline */
+    int64_t left = reaction->last_send + reaction->lead - get_monotonic_time();
+
+    if (left <= 0) {
+        return FALSE;
+    }
+    sleep_for(left < REACTION_POLL ? left : REACTION_POLL);
+    return TRUE;
 }
 
+/**
+ * reaction_received:
+ * @reaction: a Reaction instance
+ * @time:     when the reception of the refresh frame completed
+ * @ok:       whether the refresh frame was received in time
+ *
+ * Account the outcome of a send-ahead refresh and adapt the lead used
+ * by reaction_wait(): p99.9 of the roundtrips plus a margin, never
+ * below the longest roundtrip. A late frame means the distribution
+ * has a longer tail than measured, so it doubles the minimum lead.
+ */
 void
-wait_next_iteration(int64_t iteration_time, int64_t period)
+reaction_received(Reaction *reaction, int64_t time, int ok)
 {
-    if (period == 0) {
-    } else if (iteration_time > period) {
-        info("\n Time overflow (%" PRId64 " usec)\n", iteration_time);
+    int64_t roundtrip, lead;
+
+    reaction->late = ! ok;
+    if (! ok) {
+        ++reaction->misses;
+        reaction->min_lead = reaction->lead * 2;
+        if (reaction->min_lead > reaction->max_lead) {
+            reaction->min_lead = reaction->max_lead;
+        }
+        reaction->lead = reaction->min_lead;
+        return;
+    }
+
+    roundtrip = time - reaction->last_send;
+    stats_add(&reaction->roundtrip, roundtrip);
+    if (reaction->roundtrip.iterations % REACTION_UPDATE == 0) {
+        lead = stats_percentile(&reaction->roundtrip, 99.9) + REACTION_MARGIN;
     } else {
-        usleep(period - iteration_time);
+        lead = reaction->lead;
+    }
+    if (lead < reaction->roundtrip.max) {
+        lead = reaction->roundtrip.max;
+    }
+    if (lead < reaction->min_lead) {
+        lead = reaction->min_lead;
     }
+    if (lead > reaction->max_lead) {
+        lead = reaction->max_lead;
+    }
+    reaction->lead = lead;
 }
 
 static int
@@ -66,16 +391,11 @@ is_wireless(const char *iface)
 const char *
 get_default_interface(void)
 {
-    /* A bit dirty to use a static pointer to the heap...
-     * but these are test programs: no need to get picky */
-    static char *iface = NULL;
+    /* Static storage, so the returned string does not need to be
+     * freed and is not reallocated by subsequent calls */
+    static char buffer[IF_NAMESIZE];
+    const char *iface = NULL;
     struct ifaddrs *list, *item;
-    int family, s;
-
-    /* Just to avoid leaks in subsequent calls */
-    if (iface != NULL) {
-        free(iface);
-    }
 
     if (getifaddrs(&list) < 0) {
         return NULL;
@@ -89,7 +409,8 @@ get_default_interface(void)
             (item->ifa_flags & IFF_UP) > 0 &&
             ! is_wireless(item->ifa_name)
         ) {
-            iface = strdup(item->ifa_name);
+            snprintf(buffer, sizeof(buffer), "%s", item->ifa_name);
+            iface = buffer;
             break;
         }
     }
@@ -97,3 +418,2217 @@ get_default_interface(void)
     freeifaddrs(list);
     return iface;
 }
+
+/* Read the first line of a sysfs file, without the trailing newline */
+static int
+read_sysfs(const char *path, char *buffer, size_t size)
+{
+    FILE *file;
+    size_t len;
+
+    file = fopen(path, "r");
+    if (file == NULL) {
+        return FALSE;
+    }
+    if (fgets(buffer, size, file) == NULL) {
+        fclose(file);
+        return FALSE;
+    }
+    fclose(file);
+
+    len = strcspn(buffer, "\n");
+    buffer[len] = '\0';
+    return TRUE;
+}
+
+/* Size in bytes of a L1 data cache line, or -1 if unknown */
+int64_t
+get_cache_line(void)
+{
+    char buffer[16];
+    long size;
+
+    /* Not implemented by glibc on 32 bit ARM, where it returns 0 */
+    size = sysconf(_SC_LEVEL1_DCACHE_LINESIZE);
+    if (size > 0) {
+        return size;
+    }
+    if (read_sysfs("/sys/devices/system/cpu/cpu0/cache/index0/coherency_line_size",
+                   buffer, sizeof(buffer))) {
+        size = atol(buffer);
+    }
+    return size > 0 ? size : -1;
+}
+
+static int64_t
+read_clock_syscall(void)
+{
+    struct timespec ts;
+    syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+    return timespec_to_nsec(&ts);
+}
+
+/* Average cost of a @read call in nsec: best of some rounds, to filter
+ * out preemptions and interrupts */
+static int64_t
+get_read_cost(int64_t (*read)(void))
+{
+    volatile int64_t sink;
+    int64_t start, elapsed, cost;
+    int round, n;
+
+    cost = INT64_MAX;
+    for (round = 0; round < PLATFORM_ROUNDS; ++round) {
+        start = read_clock();
+        for (n = 0; n < PLATFORM_READS; ++n) {
+            sink = read();
+        }
+        elapsed = read_clock() - start;
+        if (elapsed / PLATFORM_READS < cost) {
+            cost = elapsed / PLATFORM_READS;
+        }
+    }
+
+    (void) sink;
+    return cost;
+}
+
+/* Smallest non-zero step between two consecutive CLOCK_MONOTONIC
+ * reads in nsec, -1 if the clock never advanced */
+static int64_t
+get_clock_step(void)
+{
+    int64_t previous, now, step;
+    int n;
+
+    step = INT64_MAX;
+    previous = read_clock();
+    for (n = 0; n < PLATFORM_READS; ++n) {
+        now = read_clock();
+        if (now > previous && now - previous < step) {
+            step = now - previous;
+        }
+        previous = now;
+    }
+
+    return step == INT64_MAX ? -1 : step;
+}
+
+#ifdef __x86_64__
+
+static int64_t
+read_tsc(void)
+{
+    return (int64_t) __rdtsc();
+}
+
+/* The TSC can be used as time source only if its rate is constant
+ * and it keeps running in deep C-states */
+static int
+tsc_is_invariant(void)
+{
+    char line[8192];
+    FILE *file;
+    int invariant = FALSE;
+
+    file = fopen("/proc/cpuinfo", "r");
+    if (file == NULL) {
+        return FALSE;
+    }
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, "flags", 5) == 0) {
+            invariant = strstr(line, " constant_tsc") != NULL &&
+                        strstr(line, " nonstop_tsc") != NULL;
+            break;
+        }
+    }
+    fclose(file);
+
+    return invariant;
+}
+
+/* Read CLOCK_MONOTONIC and the TSC value at the same instant, i.e.
+ * halfway through the clock read */
+static void
+tsc_sample(int64_t *time, uint64_t *ticks)
+{
+    uint64_t before = __rdtsc();
+    *time = read_clock();
+    *ticks = before + (__rdtsc() - before) / 2;
+}
+
+/* Measure the TSC rate against CLOCK_MONOTONIC and set up the scaling
+ * used by get_monotonic_time(), without enabling it */
+static int64_t
+tsc_calibrate(void)
+{
+    int64_t start, elapsed;
+    uint64_t ticks;
+
+    tsc_sample(&start, &ticks);
+    sleep_for(PLATFORM_TSC_WINDOW);
+    tsc_sample(&time_source.base, &time_source.tsc_base);
+    elapsed = time_source.base - start;
+    ticks = time_source.tsc_base - ticks;
+    time_source.mult = ((uint64_t) elapsed << 32) / ticks;
+
+    /* In kHz */
+    return ticks * 1000000 / elapsed;
+}
+
+#endif
+
+/**
+ * platform_check:
+ * @platform: where to store the results
+ * @use_tsc:  whether to use the TSC as time source, if invariant
+ *
+ * Probe the cache line size and the clock source, calibrate the
+ * resolution and the read cost of CLOCK_MONOTONIC (through the vDSO
+ * and through a system call) and of the TSC, if available, and select
+ * the time source of get_monotonic_time(). This takes a few tens of
+ * milliseconds, so it must be called before starting the bus.
+ *
+ * Returns: FALSE if CLOCK_MONOTONIC is not usable at all.
+ */
+int
+platform_check(Platform *platform, int use_tsc)
+{
+    struct timespec ts;
+
+    memset(platform, 0, sizeof(*platform));
+    if (! read_sysfs("/sys/devices/system/clocksource/clocksource0/current_clocksource",
+                     platform->clock_source, sizeof(platform->clock_source))) {
+        snprintf(platform->clock_source, sizeof(platform->clock_source), "unknown");
+    }
+    platform->cache_line = get_cache_line();
+
+    if (clock_getres(CLOCK_MONOTONIC, &ts) < 0) {
+        info("CLOCK_MONOTONIC not available: %s\n", strerror(errno));
+        return FALSE;
+    }
+    platform->clock_resolution = timespec_to_nsec(&ts);
+    platform->clock_step = get_clock_step();
+    platform->clock_cost = get_read_cost(read_clock);
+    platform->syscall_cost = get_read_cost(read_clock_syscall);
+
+    time_source.tsc = FALSE;
+#ifdef __x86_64__
+    if (tsc_is_invariant()) {
+        platform->tsc_frequency = tsc_calibrate();
+        platform->tsc_cost = get_read_cost(read_tsc);
+        time_source.tsc = use_tsc;
+    }
+#endif
+    if (use_tsc && ! time_source.tsc) {
+        info("Invariant TSC not available: using CLOCK_MONOTONIC\n");
+    }
+    platform->tsc = time_source.tsc;
+
+    /* What is actually paid by every timestamp taken by the programs */
+    platform->read_cost = get_read_cost(get_monotonic_time);
+    return TRUE;
+}
+
+void
+platform_dump(const Platform *platform)
+{
+    info("Platform: clock source %s  cache line %" PRId64
+         "  clock resolution %" PRId64 " nsec (observed %" PRId64 ")\n",
+         platform->clock_source, platform->cache_line,
+         platform->clock_resolution, platform->clock_step);
+    info("Clock read (nsec): vdso %" PRId64 "  syscall %" PRId64,
+         platform->clock_cost, platform->syscall_cost);
+    if (platform->tsc_frequency > 0) {
+        info("  tsc %" PRId64 " (%" PRId64 " kHz)",
+             platform->tsc_cost, platform->tsc_frequency);
+    }
+    info("  %s timestamps %" PRId64 " (subtracted from the measured times)\n",
+         platform->tsc ? "tsc" : "clock", platform->read_cost);
+
+    if (platform->clock_step > 1000) {
+        info("Warning: the clock advances in %" PRId64 " nsec steps, "
+             "shorter times are not measurable\n", platform->clock_step);
+    }
+    /* A vDSO read is an order of magnitude cheaper than a syscall */
+    if (platform->clock_cost * 2 > platform->syscall_cost) {
+        info("Warning: CLOCK_MONOTONIC is not read through the vDSO\n");
+    }
+#ifdef __arm__
+    /* The 32 bit ARM vDSO can only read the architected timer: with
+     * any other clock source every read falls back to a system call */
+    if (strcmp(platform->clock_source, "arch_sys_counter") != 0) {
+        info("Warning: clock source '%s' cannot be read by the vDSO\n",
+             platform->clock_source);
+    }
+    if (platform->cache_line < 0) {
+        info("Warning: unknown cache line size (32 bytes on Cortex-A9, "
+             "64 on Cortex-A8)\n");
+    }
+#endif
+}
+
+/* Allocations performed by the current thread */
+static __thread uint64_t allocations = 0;
+
+#ifdef __GLIBC__
+
+/* Wrap the glibc allocator to count the allocations: the symbols
+ * defined here take precedence over the ones in the C library */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *
+malloc(size_t size)
+{
+    ++allocations;
+    return __libc_malloc(size);
+}
+
+void *
+calloc(size_t nmemb, size_t size)
+{
+    ++allocations;
+    return __libc_calloc(nmemb, size);
+}
+
+void *
+realloc(void *ptr, size_t size)
+{
+    ++allocations;
+    return __libc_realloc(ptr, size);
+}
+
+#endif
+
+/**
+ * memcheck_prepare:
+ *
+ * Make the memory of the process resident: lock current and future
+ * pages, prevent glibc from giving memory back to the kernel (so it
+ * will not be faulted in again) and prefault a chunk of stack.
+ *
+ * Returns: FALSE if the memory cannot be locked or glibc tuned.
+ */
+int
+memcheck_prepare(void)
+{
+    volatile char stack[256 * 1024];
+    size_t n;
+
+    /* mallopt() returns 0 on errors */
+    if (mallopt(M_TRIM_THRESHOLD, -1) == 0 || mallopt(M_MMAP_MAX, 0) == 0) {
+        info("Unable to tune the allocator\n");
+        return FALSE;
+    }
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+        info("Unable to lock the memory: %s\n", strerror(errno));
+        return FALSE;
+    }
+
+    for (n = 0; n < sizeof(stack); n += 4096) {
+        stack[n] = 0;
+    }
+
+    return TRUE;
+}
+
+/* For allocators not based on malloc (e.g. the zig ones) */
+void
+memcheck_count_allocation(void)
+{
+    ++allocations;
+}
+
+/* Get the memory usage of the current thread */
+void
+memcheck_sample(MemoryUsage *usage)
+{
+    struct rusage rusage;
+
+    usage->allocations = allocations;
+    if (getrusage(RUSAGE_THREAD, &rusage) == 0) {
+        usage->minor_faults = rusage.ru_minflt;
+        usage->major_faults = rusage.ru_majflt;
+    } else {
+        usage->minor_faults = 0;
+        usage->major_faults = 0;
+    }
+}
+
+void
+options_initialize(Options *options)
+{
+    memset(options, 0, sizeof(*options));
+    options->nic_profile = NULL;
+    options->output = NULL;
+    options->label = NULL;
+    options->interference = NULL;
+    options->iterations = 0;
+    options->warmup = 0;
+    options->overrun = OVERRUN_RELATIVE;
+    options->sdo_rate = 0;
+    /* Vendor ID: available on every CoE device */
+    options->sdo_index = 0x1018;
+    options->sdo_subindex = 1;
+    options->sdo_write = FALSE;
+    options->break_iface = NULL;
+    options->break_at = 0;
+    options->break_duration = 0;
+    options->nsweep = 0;
+}
+
+static const char *
+option_value(int argc, char *argv[], int *n)
+{
+    if (*n + 1 >= argc) {
+        info("Missing value for '%s'\n", argv[*n]);
+        return NULL;
+    }
+    ++*n;
+    return argv[*n];
+}
+
+static int
+parse_count(uint64_t *count, const char *text)
+{
+    char *endptr;
+
+    if (text == NULL) {
+        return FALSE;
+    }
+
+    *count = strtoull(text, &endptr, 10);
+    if (*text == '\0' || *endptr != '\0') {
+        info("Invalid count '%s'\n", text);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int
+parse_overrun(OverrunPolicy *policy, const char *text)
+{
+    size_t n;
+
+    if (text == NULL) {
+        return FALSE;
+    }
+
+    for (n = 0; n < sizeof(overrun_policies) / sizeof(overrun_policies[0]); ++n) {
+        if (strcmp(overrun_policies[n], text) == 0) {
+            *policy = n;
+            return TRUE;
+        }
+    }
+
+    info("Invalid overrun policy '%s'\n", text);
+    return FALSE;
+}
+
+/* Parse `RATE[@INDEX:SUBINDEX]` */
+static int
+parse_sdo(Options *options, const char *text)
+{
+    char *endptr;
+    unsigned long index, subindex;
+
+    if (text == NULL) {
+        return FALSE;
+    }
+
+    options->sdo_rate = strtol(text, &endptr, 10);
+    if (endptr == text || options->sdo_rate < 0) {
+        info("Invalid mailbox rate in '%s'\n", text);
+        return FALSE;
+    }
+    if (*endptr == '\0') {
+        return TRUE;
+    } else if (*endptr != '@') {
+        info("Invalid mailbox specification '%s'\n", text);
+        return FALSE;
+    }
+
+    text = endptr + 1;
+    index = strtoul(text, &endptr, 0);
+    if (endptr == text || *endptr != ':' || index > 0xFFFF) {
+        info("Invalid CoE index in '%s'\n", text);
+        return FALSE;
+    }
+    text = endptr + 1;
+    subindex = strtoul(text, &endptr, 0);
+    if (endptr == text || *endptr != '\0' || subindex > 0xFF) {
+        info("Invalid CoE subindex in '%s'\n", text);
+        return FALSE;
+    }
+
+    options->sdo_index = index;
+    options->sdo_subindex = subindex;
+    options->sdo_write = TRUE;
+    return TRUE;
+}
+
+/* Parse a time in msec (possibly with decimals) into nsec */
+static int
+parse_msec(int64_t *time, const char *text, char **endptr)
+{
+    double value = strtod(text, endptr);
+    if (*endptr == text || value < 0) {
+        return FALSE;
+    }
+    *time = value * 1000000;
+    return TRUE;
+}
+
+/* Parse `IFACE@AT[:DURATION]`, with times in msec */
+static int
+parse_break(Options *options, const char *text)
+{
+    const char *at;
+    char *endptr;
+
+    if (text == NULL) {
+        return FALSE;
+    }
+
+    at = strchr(text, '@');
+    if (at == NULL || at == text || at - text >= IF_NAMESIZE) {
+        info("Invalid cable break specification '%s'\n", text);
+        return FALSE;
+    }
+    if (! parse_msec(&options->break_at, at + 1, &endptr)) {
+        info("Invalid cable break time in '%s'\n", text);
+        return FALSE;
+    }
+    options->break_duration = 0;
+    if (*endptr == ':' &&
+        (! parse_msec(&options->break_duration, endptr + 1, &endptr) ||
+         options->break_duration == 0)) {
+        info("Invalid cable break duration in '%s'\n", text);
+        return FALSE;
+    }
+    if (*endptr != '\0') {
+        info("Invalid cable break specification '%s'\n", text);
+        return FALSE;
+    }
+
+    /* Never freed: the options last for the whole program */
+    options->break_iface = strndup(text, at - text);
+    return options->break_iface != NULL;
+}
+
+/* Parse a comma separated list of `[POLICY:]VALUE` items */
+static int
+parse_sweep(Options *options, const char *text)
+{
+    SchedSpec *spec;
+    const char *colon;
+    char *endptr;
+    size_t n, len;
+
+    if (text == NULL) {
+        return FALSE;
+    }
+
+    options->nsweep = 0;
+    while (*text != '\0') {
+        if (options->nsweep >= OPTIONS_MAX_SWEEP) {
+            info("Too many sweep items (max %d)\n", OPTIONS_MAX_SWEEP);
+            return FALSE;
+        }
+
+        spec = options->sweep + options->nsweep;
+        spec->policy = SCHED_OTHER;
+        colon = strpbrk(text, ":,");
+        if (colon != NULL && *colon == ':') {
+            len = colon - text;
+            spec->policy = -1;
+            for (n = 0; n < sizeof(policies) / sizeof(policies[0]); ++n) {
+                if (strlen(policies[n].name) == len &&
+                    strncmp(policies[n].name, text, len) == 0) {
+                    spec->policy = policies[n].policy;
+                    break;
+                }
+            }
+            if (spec->policy < 0) {
+                info("Invalid scheduling policy in '%s'\n", text);
+                return FALSE;
+            }
+            text = colon + 1;
+        }
+
+        spec->value = strtol(text, &endptr, 10);
+        if (endptr == text || (*endptr != '\0' && *endptr != ',')) {
+            info("Invalid sweep item '%s'\n", text);
+            return FALSE;
+        }
+
+        ++options->nsweep;
+        text = *endptr == ',' ? endptr + 1 : endptr;
+    }
+
+    return options->nsweep > 0;
+}
+
+/**
+ * options_parse:
+ * @options: where to store the parsed values
+ * @argc:    number of arguments
+ * @argv:    the arguments vector
+ * @n:       index of the argument to parse
+ *
+ * Check if the `argv[*n]` argument is an option shared by all the
+ * test programs. If the option takes a value, `*n` is advanced.
+ *
+ * Returns: 1 if the argument has been consumed, 0 if it is not a
+ *          shared option, -1 on errors.
+ */
+int
+options_parse(Options *options, int argc, char *argv[], int *n)
+{
+    const char *arg = argv[*n];
+
+    if (strcmp(arg, "-n") == 0 || strcmp(arg, "--nic-profile") == 0) {
+        options->nic_profile = option_value(argc, argv, n);
+        return options->nic_profile != NULL ? 1 : -1;
+    } else if (strcmp(arg, "-o") == 0 || strcmp(arg, "--output") == 0) {
+        options->output = option_value(argc, argv, n);
+        return options->output != NULL ? 1 : -1;
+    } else if (strcmp(arg, "-l") == 0 || strcmp(arg, "--label") == 0) {
+        options->label = option_value(argc, argv, n);
+        return options->label != NULL ? 1 : -1;
+    } else if (strcmp(arg, "-e") == 0 || strcmp(arg, "--interference") == 0) {
+        options->interference = option_value(argc, argv, n);
+        return options->interference != NULL ? 1 : -1;
+    } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--iterations") == 0) {
+        return parse_count(&options->iterations, option_value(argc, argv, n)) ? 1 : -1;
+    } else if (strcmp(arg, "-w") == 0 || strcmp(arg, "--warmup") == 0) {
+        return parse_count(&options->warmup, option_value(argc, argv, n)) ? 1 : -1;
+    } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--sweep") == 0) {
+        return parse_sweep(options, option_value(argc, argv, n)) ? 1 : -1;
+    } else if (strcmp(arg, "-O") == 0 || strcmp(arg, "--overrun") == 0) {
+        return parse_overrun(&options->overrun, option_value(argc, argv, n)) ? 1 : -1;
+    } else if (strcmp(arg, "-S") == 0 || strcmp(arg, "--sdo") == 0) {
+        return parse_sdo(options, option_value(argc, argv, n)) ? 1 : -1;
+    } else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--memcheck") == 0) {
+        options->memcheck = TRUE;
+        return 1;
+    } else if (strcmp(arg, "-a") == 0 || strcmp(arg, "--send-ahead") == 0) {
+        options->send_ahead = TRUE;
+        return 1;
+    } else if (strcmp(arg, "-c") == 0 || strcmp(arg, "--capture") == 0) {
+        options->capture = option_value(argc, argv, n);
+        return options->capture != NULL ? 1 : -1;
+    } else if (strcmp(arg, "-p") == 0 || strcmp(arg, "--publish") == 0) {
+        options->publish = option_value(argc, argv, n);
+        return options->publish != NULL ? 1 : -1;
+    } else if (strcmp(arg, "-B") == 0 || strcmp(arg, "--break") == 0) {
+        return parse_break(options, option_value(argc, argv, n)) ? 1 : -1;
+    } else if (strcmp(arg, "-T") == 0 || strcmp(arg, "--tsc") == 0) {
+        options->tsc = TRUE;
+        return 1;
+    } else if (strcmp(arg, "-P") == 0 || strcmp(arg, "--platform") == 0) {
+        /* Does not need any bus, so it can be used as a smoke test
+         * of cross-compiled binaries (e.g. under qemu-user) */
+        Platform platform;
+        if (! platform_check(&platform, options->tsc)) {
+            exit(2);
+        }
+        platform_dump(&platform);
+        exit(0);
+    }
+
+    return 0;
+}
+
+void
+options_usage(void)
+{
+    size_t n;
+
+    info("Shared options:\n"
+         "  -n, --nic-profile PROFILE  Apply a NIC profile before running (");
+    for (n = 0; n < sizeof(nic_profiles) / sizeof(nic_profiles[0]); ++n) {
+        info("%s%s", n == 0 ? "" : ", ", nic_profiles[n].name);
+    }
+    info(")\n"
+         "  -o, --output FILE          Append the result record to FILE (JSON\n"
+         "                             if FILE ends with '.json', CSV otherwise)\n"
+         "  -l, --label LABEL          Free text stored in the result record\n"
+         "  -e, --interference NAME    Interference running during the test,\n"
+         "                             stored in the result record\n"
+         "  -i, --iterations N         Iterations of every measurement window\n"
+         "  -w, --warmup N             Iterations to run before measuring\n"
+         "  -s, --sweep LIST           Comma separated list of [POLICY:]VALUE\n"
+         "                             items (e.g. '-20,-10,fifo:80'): a\n"
+         "                             measurement window is run for each item\n"
+         "                             without restarting the bus. VALUE is the\n"
+         "                             niceness or, for fifo and rr policies,\n"
+         "                             the static priority\n"
+         "  -O, --overrun POLICY       What to do when an iteration exceeds\n"
+         "                             its slot: relative (sleep for period\n"
+         "                             minus iteration time, default), skip\n"
+         "                             (wait the next slot boundary), catchup\n"
+         "                             (run the missed iterations back to back)\n"
+         "                             or realign (run at once, then go on\n"
+         "                             with the next slot boundary)\n"
+         "  -S, --sdo RATE[@IDX:SUB]   Access a CoE object RATE times per second\n"
+         "                             from a non real-time thread, while the\n"
+         "                             loop is running. By default 0x1018:1 is\n"
+         "                             read, an explicit object is read and\n"
+         "                             written back (e.g. '100@0x8000:6')\n"
+         "  -m, --memcheck             Lock the memory before starting and\n"
+         "                             fail if any heap allocation or page\n"
+         "                             fault happens in the loop after the\n"
+         "                             warm-up\n"
+         "  -a, --send-ahead           Refresh the inputs with an additional\n"
+         "                             frame right before computing the\n"
+         "                             outputs, to shrink the I/O reaction time\n"
+         "  -c, --capture FILE         Save the EtherCAT frames in FILE (pcapng),\n"
+         "                             to be replayed with `ethercatest-replay`\n"
+         "  -p, --publish NAME         Publish live metrics in shared memory,\n"
+         "                             to be watched with `ethercatest-top NAME`\n"
+         "  -B, --break IFACE@AT[:DURATION]\n"
+         "                             Simulate a cable break bringing IFACE\n"
+         "                             (e.g. the simulator end of a veth pair)\n"
+         "                             down AT msec after the start of every\n"
+         "                             window, for DURATION msec or until the\n"
+         "                             end of the window\n"
+         "  -T, --tsc                  Take the timestamps from the TSC instead\n"
+         "                             of CLOCK_MONOTONIC (invariant TSC only)\n"
+         "  -P, --platform             Check cache line, clock source, clock\n"
+         "                             resolution and clock read cost, then exit\n"
+         "                             (must follow `--tsc`, if used)\n");
+}
+
+/* Number of measurement windows to run: one for every sweep item */
+int
+options_get_windows(const Options *options)
+{
+    return options->nsweep > 0 ? options->nsweep : 1;
+}
+
+uint64_t
+options_get_iterations(const Options *options, long period)
+{
+    if (options->iterations > 0) {
+        return options->iterations;
+    }
+    return 100000 / (period / 100 + 3);
+}
+
+/**
+ * sched_apply:
+ * @spec: the scheduling to apply
+ *
+ * Change the scheduling of the calling thread according to @spec.
+ *
+ * Returns: TRUE on success, FALSE on errors.
+ */
+int
+sched_apply(const SchedSpec *spec)
+{
+    struct sched_param param;
+    int is_rt = spec->policy == SCHED_FIFO || spec->policy == SCHED_RR;
+
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = is_rt ? spec->value : 0;
+    if (sched_setscheduler(0, spec->policy, &param) < 0) {
+        info("Unable to set scheduling policy %d (priority %d): %s\n",
+             spec->policy, param.sched_priority, strerror(errno));
+        return FALSE;
+    }
+
+    if (! is_rt && setpriority(PRIO_PROCESS, 0, spec->value) < 0) {
+        info("Unable to set niceness %d: %s\n", spec->value, strerror(errno));
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static int
+ethtool_ioctl(const char *iface, void *data)
+{
+    struct ifreq ifr;
+    int fd, status;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, sizeof(ifr.ifr_name) - 1);
+    ifr.ifr_data = data;
+    status = ioctl(fd, SIOCETHTOOL, &ifr);
+    close(fd);
+
+    return status == 0;
+}
+
+static int64_t
+ethtool_get_value(const char *iface, uint32_t cmd)
+{
+    struct ethtool_value value = { .cmd = cmd };
+    return ethtool_ioctl(iface, &value) ? (int64_t) value.data : -1;
+}
+
+static int
+ethtool_set_value(const char *iface, uint32_t cmd, uint32_t data)
+{
+    struct ethtool_value value = { .cmd = cmd, .data = data };
+    return ethtool_ioctl(iface, &value);
+}
+
+/**
+ * nic_get_settings:
+ * @settings: where to store the NIC settings
+ * @iface:    the network interface to query
+ *
+ * Read interrupt coalescing, ring sizes and offloads of @iface by
+ * using the ethtool ioctls. Not every driver implements all of them
+ * (e.g. `veth` has no coalescing): the missing values are left to -1.
+ *
+ * Returns: TRUE if at least one parameter has been read.
+ */
+int
+nic_get_settings(NicSettings *settings, const char *iface)
+{
+    struct ethtool_coalesce coalesce = { .cmd = ETHTOOL_GCOALESCE };
+    struct ethtool_ringparam ring = { .cmd = ETHTOOL_GRINGPARAM };
+    int found = FALSE;
+
+    memset(settings, 0, sizeof(*settings));
+    if (iface == NULL) {
+        iface = "";
+    }
+    strncpy(settings->iface, iface, sizeof(settings->iface) - 1);
+
+    if (ethtool_ioctl(iface, &coalesce)) {
+        settings->rx_usecs = coalesce.rx_coalesce_usecs;
+        settings->rx_frames = coalesce.rx_max_coalesced_frames;
+        settings->tx_usecs = coalesce.tx_coalesce_usecs;
+        settings->tx_frames = coalesce.tx_max_coalesced_frames;
+        settings->adaptive_rx = coalesce.use_adaptive_rx_coalesce;
+        settings->adaptive_tx = coalesce.use_adaptive_tx_coalesce;
+        found = TRUE;
+    } else {
+        settings->rx_usecs = settings->rx_frames = -1;
+        settings->tx_usecs = settings->tx_frames = -1;
+        settings->adaptive_rx = settings->adaptive_tx = -1;
+    }
+
+    if (ethtool_ioctl(iface, &ring)) {
+        settings->rx_ring = ring.rx_pending;
+        settings->tx_ring = ring.tx_pending;
+        found = TRUE;
+    } else {
+        settings->rx_ring = settings->tx_ring = -1;
+    }
+
+    settings->gro = ethtool_get_value(iface, ETHTOOL_GGRO);
+    settings->gso = ethtool_get_value(iface, ETHTOOL_GGSO);
+    settings->tso = ethtool_get_value(iface, ETHTOOL_GTSO);
+    settings->rx_csum = ethtool_get_value(iface, ETHTOOL_GRXCSUM);
+    settings->tx_csum = ethtool_get_value(iface, ETHTOOL_GTXCSUM);
+
+    return found || settings->gro >= 0 || settings->rx_csum >= 0;
+}
+
+/**
+ * nic_apply_profile:
+ * @iface:   the network interface to modify
+ * @profile: name of the profile to apply
+ *
+ * Apply one of the profiles in `nic_profiles` to @iface. Parameters
+ * not supported by the driver are silently skipped, but any failure
+ * on a supported one is considered an error.
+ *
+ * Returns: TRUE on success, FALSE on errors.
+ */
+int
+nic_apply_profile(const char *iface, const char *profile)
+{
+    const NicProfile *p = NULL;
+    struct ethtool_coalesce coalesce = { .cmd = ETHTOOL_GCOALESCE };
+    struct ethtool_ringparam ring = { .cmd = ETHTOOL_GRINGPARAM };
+    size_t n;
+
+    for (n = 0; n < sizeof(nic_profiles) / sizeof(nic_profiles[0]); ++n) {
+        if (strcmp(nic_profiles[n].name, profile) == 0) {
+            p = nic_profiles + n;
+            break;
+        }
+    }
+    if (p == NULL) {
+        info("Unknown NIC profile '%s'\n", profile);
+        return FALSE;
+    }
+    if (iface == NULL) {
+        info("No interface to apply the '%s' NIC profile\n", profile);
+        return FALSE;
+    }
+
+    if ((p->usecs >= 0 || p->frames >= 0) && ethtool_ioctl(iface, &coalesce)) {
+        coalesce.cmd = ETHTOOL_SCOALESCE;
+        coalesce.use_adaptive_rx_coalesce = 0;
+        coalesce.use_adaptive_tx_coalesce = 0;
+        if (p->usecs >= 0) {
+            coalesce.rx_coalesce_usecs = p->usecs;
+            coalesce.tx_coalesce_usecs = p->usecs;
+        }
+        if (p->frames >= 0) {
+            coalesce.rx_max_coalesced_frames = p->frames;
+            coalesce.tx_max_coalesced_frames = p->frames;
+        }
+        if (! ethtool_ioctl(iface, &coalesce)) {
+            info("Unable to set interrupt coalescing on '%s'\n", iface);
+            return FALSE;
+        }
+    }
+
+    if (p->ring >= 0 && ethtool_ioctl(iface, &ring)) {
+        ring.cmd = ETHTOOL_SRINGPARAM;
+        ring.rx_pending = (uint32_t) p->ring < ring.rx_max_pending ? (uint32_t) p->ring : ring.rx_max_pending;
+        ring.tx_pending = (uint32_t) p->ring < ring.tx_max_pending ? (uint32_t) p->ring : ring.tx_max_pending;
+        if (! ethtool_ioctl(iface, &ring)) {
+            info("Unable to set ring sizes on '%s'\n", iface);
+            return FALSE;
+        }
+    }
+
+    if (p->offload >= 0) {
+        /* Offloads can be fixed by the driver: ignore failures here
+         * and let `nic_get_settings()` show the real status */
+        ethtool_set_value(iface, ETHTOOL_SGRO, p->offload);
+        ethtool_set_value(iface, ETHTOOL_SGSO, p->offload);
+        ethtool_set_value(iface, ETHTOOL_STSO, p->offload);
+        ethtool_set_value(iface, ETHTOOL_SRXCSUM, p->offload);
+        ethtool_set_value(iface, ETHTOOL_STXCSUM, p->offload);
+    }
+
+    return TRUE;
+}
+
+/**
+ * nic_setup:
+ * @settings: where to store the NIC settings
+ * @iface:    the network interface
+ * @options:  the parsed options
+ *
+ * Apply the NIC profile requested in @options (if any) to @iface and
+ * read back the resulting settings, so they can be reported
+ * together with the results.
+ *
+ * Returns: FALSE if the NIC profile cannot be applied.
+ */
+int
+nic_setup(NicSettings *settings, const char *iface, const Options *options)
+{
+    if (options->nic_profile != NULL) {
+        info("Applying '%s' NIC profile... ", options->nic_profile);
+        if (! nic_apply_profile(iface, options->nic_profile)) {
+            return FALSE;
+        }
+        info("done\n");
+    }
+
+    nic_get_settings(settings, iface);
+    return TRUE;
+}
+
+void
+nic_dump(const NicSettings *settings)
+{
+    info("NIC settings: iface %s  rx-usecs %" PRId64 "  rx-frames %" PRId64
+         "  tx-usecs %" PRId64 "  tx-frames %" PRId64
+         "  adaptive-rx %" PRId64 "  adaptive-tx %" PRId64
+         "  rx-ring %" PRId64 "  tx-ring %" PRId64
+         "  gro %" PRId64 "  gso %" PRId64 "  tso %" PRId64
+         "  rx-csum %" PRId64 "  tx-csum %" PRId64 "\n",
+         settings->iface[0] != '\0' ? settings->iface : "-",
+         settings->rx_usecs, settings->rx_frames,
+         settings->tx_usecs, settings->tx_frames,
+         settings->adaptive_rx, settings->adaptive_tx,
+         settings->rx_ring, settings->tx_ring,
+         settings->gro, settings->gso, settings->tso,
+         settings->rx_csum, settings->tx_csum);
+}
+
+static int
+stats_bucket(int64_t value)
+{
+    uint64_t v = value < 0 ? 0 : (uint64_t) value;
+    int shift;
+
+    if (v < (2 << STATS_SUB_BITS)) {
+        return v;
+    }
+
+    shift = 63 - __builtin_clzll(v) - STATS_SUB_BITS;
+    return ((shift + 1) << STATS_SUB_BITS) + (int) (v >> shift) - (1 << STATS_SUB_BITS);
+}
+
+static int64_t
+stats_bucket_upper(int bucket)
+{
+    int shift;
+    int64_t base;
+
+    if (bucket < (2 << STATS_SUB_BITS)) {
+        return bucket;
+    }
+
+    shift = (bucket >> STATS_SUB_BITS) - 1;
+    base = (bucket & ((1 << STATS_SUB_BITS) - 1)) + (1 << STATS_SUB_BITS);
+    return ((base + 1) << shift) - 1;
+}
+
+static void *
+mailbox_thread(void *data)
+{
+    Mailbox *mailbox = data;
+    SchedSpec spec = { .policy = SCHED_OTHER, .value = 0 };
+    int64_t interval, next, now, start, stop;
+    int ok;
+
+    /* The mailbox traffic must not compete with the cyclic loop */
+    sched_apply(&spec);
+
+    interval = 1000000000 / mailbox->options->sdo_rate;
+    next = read_clock();
+    for (;;) {
+        /* `busy` must be set before checking `running`:
+         * see mailbox_halt() for the other side */
+        __atomic_store_n(&mailbox->busy, TRUE, __ATOMIC_SEQ_CST);
+        if (! __atomic_load_n(&mailbox->running, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        start = get_monotonic_time();
+        ok = mailbox->callback(mailbox->data, mailbox->options);
+        stop = get_monotonic_time();
+        __atomic_store_n(&mailbox->busy, FALSE, __ATOMIC_SEQ_CST);
+
+        pthread_mutex_lock(&mailbox->mutex);
+        if (ok) {
+            stats_add(&mailbox->latency, stop - start);
+        } else {
+            ++mailbox->errors;
+        }
+        pthread_mutex_unlock(&mailbox->mutex);
+
+        /* When a transaction takes longer than the interval,
+         * the next one is started immediately */
+        next += interval;
+        now = read_clock();
+        if (next < now) {
+            next = now;
+        }
+        sleep_until(next);
+    }
+
+    __atomic_store_n(&mailbox->busy, FALSE, __ATOMIC_SEQ_CST);
+    return NULL;
+}
+
+/**
+ * mailbox_start:
+ * @mailbox:  a Mailbox instance
+ * @callback: the function performing a single transaction
+ * @data:     data to pass to @callback
+ * @options:  the parsed options
+ *
+ * Start a thread that calls @callback `options->sdo_rate` times per
+ * second, collecting the latency of every transaction. If the rate is
+ * 0, no thread is started and @mailbox is left idle.
+ *
+ * Returns: FALSE if the thread cannot be started.
+ */
+int
+mailbox_start(Mailbox *mailbox, MailboxCallback callback, void *data,
+              const Options *options)
+{
+    memset(mailbox, 0, sizeof(*mailbox));
+    mailbox->callback = callback;
+    mailbox->data = data;
+    mailbox->options = options;
+    pthread_mutex_init(&mailbox->mutex, NULL);
+
+    if (options->sdo_rate <= 0) {
+        return TRUE;
+    }
+
+    mailbox->running = TRUE;
+    if (pthread_create(&mailbox->thread, NULL, mailbox_thread, mailbox) != 0) {
+        mailbox->running = FALSE;
+        info("Unable to start the mailbox thread\n");
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+/**
+ * mailbox_halt:
+ * @mailbox: a Mailbox instance
+ *
+ * Ask the mailbox thread to not start new transactions. A transaction
+ * could still be in progress: use mailbox_is_busy() to check it.
+ */
+void
+mailbox_halt(Mailbox *mailbox)
+{
+    __atomic_store_n(&mailbox->running, FALSE, __ATOMIC_SEQ_CST);
+}
+
+int
+mailbox_is_busy(Mailbox *mailbox)
+{
+    return __atomic_load_n(&mailbox->busy, __ATOMIC_SEQ_CST);
+}
+
+void
+mailbox_stop(Mailbox *mailbox)
+{
+    if (mailbox->options->sdo_rate > 0) {
+        mailbox_halt(mailbox);
+        pthread_join(mailbox->thread, NULL);
+    }
+    pthread_mutex_destroy(&mailbox->mutex);
+}
+
+/* Bring the link of @iface up or down, as `ip link set` does */
+static int
+link_set(const char *iface, int up)
+{
+    struct ifreq ifr;
+    int fd, status;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        return FALSE;
+    }
+
+    memset(&ifr, 0, sizeof(ifr));
+    strncpy(ifr.ifr_name, iface, sizeof(ifr.ifr_name) - 1);
+    status = ioctl(fd, SIOCGIFFLAGS, &ifr);
+    if (status == 0) {
+        if (up) {
+            ifr.ifr_flags |= IFF_UP;
+        } else {
+            ifr.ifr_flags &= ~IFF_UP;
+        }
+        status = ioctl(fd, SIOCSIFFLAGS, &ifr);
+    }
+    if (status < 0) {
+        info("\nUnable to bring '%s' %s: %s\n", iface, up ? "up" : "down",
+             strerror(errno));
+    }
+    close(fd);
+
+    return status == 0;
+}
+
+static void *
+fault_thread(void *data)
+{
+    Fault *fault = data;
+    int64_t broken;
+    int state, ok;
+
+    sleep_until(fault->timer_start + fault->at);
+
+    /* Do not leak the socket if cancelled in the middle */
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    ok = link_set(fault->iface, FALSE);
+    if (ok) {
+        broken = read_clock();
+        __atomic_store_n(&fault->broken, get_monotonic_time(), __ATOMIC_RELEASE);
+    }
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &state);
+    if (! ok || fault->duration <= 0) {
+        return NULL;
+    }
+
+    sleep_until(broken + fault->duration);
+
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &state);
+    if (link_set(fault->iface, TRUE)) {
+        __atomic_store_n(&fault->restored, get_monotonic_time(), __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/* Arm the cable break for the window starting now */
+static int
+fault_start(Fault *fault)
+{
+    int status;
+
+    fault->start = get_monotonic_time();
+    fault->timer_start = read_clock();
+    fault->broken = 0;
+    fault->restored = 0;
+    fault->recovered = 0;
+    fault->errors_before = 0;
+    fault->wkc_errors_seen = 0;
+    fault->failed = 0;
+    fault->lost = 0;
+    stats_reset(&fault->before);
+    stats_reset(&fault->during);
+    if (fault->iface == NULL) {
+        return TRUE;
+    }
+
+    status = pthread_create(&fault->thread, NULL, fault_thread, fault);
+    if (status != 0) {
+        info("Unable to start the cable break thread: %s\n", strerror(status));
+        return FALSE;
+    }
+    fault->running = TRUE;
+    return TRUE;
+}
+
+/* Disarm the cable break, repairing the link if still broken */
+static void
+fault_stop(Fault *fault)
+{
+    if (! fault->running) {
+        return;
+    }
+
+    pthread_cancel(fault->thread);
+    pthread_join(fault->thread, NULL);
+    fault->running = FALSE;
+    if (fault->broken > 0 && fault->restored == 0 && link_set(fault->iface, TRUE)) {
+        fault->restored = get_monotonic_time();
+    }
+}
+
+/* Account an iteration of @time nsec, just completed. Iterations
+ * started before the break do not count as recovered: their frames
+ * could have been sent while the link was still up. Neither do the
+ * ones whose send-ahead refresh frame did not come back in time. */
+static void
+fault_account(Fault *fault, const Report *report, int64_t time)
+{
+    int64_t broken, restored, now;
+    int ok;
+
+    ok = report->wkc_errors == fault->wkc_errors_seen && ! report->reaction.late;
+    fault->wkc_errors_seen = report->wkc_errors;
+
+    broken = __atomic_load_n(&fault->broken, __ATOMIC_ACQUIRE);
+    if (broken == 0) {
+        stats_add(&fault->before, time);
+        fault->errors_before = report->errors;
+        return;
+    }
+
+    now = get_monotonic_time();
+    restored = __atomic_load_n(&fault->restored, __ATOMIC_ACQUIRE);
+    if (restored == 0 || now - time < restored) {
+        stats_add(&fault->during, time);
+    }
+    if (fault->recovered != 0) {
+        return;
+    }
+    if (! ok) {
+        ++fault->failed;
+    } else if (now - time >= broken) {
+        fault->recovered = now;
+        fault->lost = report->errors - fault->errors_before + fault->failed;
+    }
+}
+
+static int
+pcapng_write_u32(FILE *file, uint32_t value)
+{
+    return fwrite(&value, sizeof(value), 1, file) == 1;
+}
+
+static int
+pcapng_write_option(FILE *file, uint16_t code, const void *data, uint16_t size)
+{
+    static const uint8_t padding[4] = { 0 };
+    uint16_t header[2] = { code, size };
+
+    return fwrite(header, sizeof(header), 1, file) == 1 &&
+           fwrite(data, 1, size, file) == size &&
+           fwrite(padding, 1, -size & 3, file) == (-size & 3u);
+}
+
+/**
+ * pcapng_write_header:
+ * @file:  the output file
+ * @iface: name of the captured interface
+ *
+ * Write the section header and the description of the only interface,
+ * with nanosecond timestamps. Everything is in host byte order, as
+ * allowed by the format.
+ *
+ * Returns: FALSE on write errors.
+ */
+int
+pcapng_write_header(FILE *file, const char *iface)
+{
+    const uint8_t tsresol = 9;
+    uint16_t linktype[2] = { PCAPNG_LINKTYPE_ETHERNET, 0 };
+    int64_t section_length = -1;
+    uint16_t version[2] = { 1, 0 };
+    uint16_t name_size = strlen(iface);
+    uint32_t size;
+
+    size = 28;
+    if (! pcapng_write_u32(file, PCAPNG_SHB) ||
+        ! pcapng_write_u32(file, size) ||
+        ! pcapng_write_u32(file, PCAPNG_BYTE_ORDER) ||
+        fwrite(version, sizeof(version), 1, file) != 1 ||
+        fwrite(&section_length, sizeof(section_length), 1, file) != 1 ||
+        ! pcapng_write_u32(file, size)) {
+        return FALSE;
+    }
+
+    size = 20 + 4 + ((name_size + 3) & ~3) + 4 + 4 + 4;
+    return pcapng_write_u32(file, PCAPNG_IDB) &&
+           pcapng_write_u32(file, size) &&
+           fwrite(linktype, sizeof(linktype), 1, file) == 1 &&
+           pcapng_write_u32(file, 0) &&
+           pcapng_write_option(file, PCAPNG_IF_NAME, iface, name_size) &&
+           pcapng_write_option(file, PCAPNG_IF_TSRESOL, &tsresol, 1) &&
+           pcapng_write_option(file, PCAPNG_OPT_END, NULL, 0) &&
+           pcapng_write_u32(file, size);
+}
+
+/**
+ * pcapng_write_packet:
+ * @file:      the output file
+ * @timestamp: capture time, in nanoseconds
+ * @data:      the frame
+ * @size:      size of @data
+ * @outbound:  TRUE for transmitted frames, FALSE for received ones
+ *
+ * Write an enhanced packet block, with the direction in `epb_flags`.
+ *
+ * Returns: FALSE on write errors.
+ */
+int
+pcapng_write_packet(FILE *file, uint64_t timestamp,
+                    const void *data, size_t size, int outbound)
+{
+    static const uint8_t padding[4] = { 0 };
+    uint32_t flags = outbound ? 2 : 1;
+    uint32_t block_size = 28 + ((size + 3) & ~3) + 8 + 4 + 4;
+
+    return pcapng_write_u32(file, PCAPNG_EPB) &&
+           pcapng_write_u32(file, block_size) &&
+           pcapng_write_u32(file, 0) &&
+           pcapng_write_u32(file, timestamp >> 32) &&
+           pcapng_write_u32(file, timestamp & 0xFFFFFFFF) &&
+           pcapng_write_u32(file, size) &&
+           pcapng_write_u32(file, size) &&
+           fwrite(data, 1, size, file) == size &&
+           fwrite(padding, 1, -size & 3, file) == (-size & 3u) &&
+           pcapng_write_option(file, PCAPNG_EPB_FLAGS, &flags, sizeof(flags)) &&
+           pcapng_write_option(file, PCAPNG_OPT_END, NULL, 0) &&
+           pcapng_write_u32(file, block_size);
+}
+
+static void *
+capture_thread(void *data)
+{
+    Capture *capture = data;
+    uint8_t frame[ETH_FRAME_LEN + 4];
+    char control[CMSG_SPACE(sizeof(struct timespec))];
+    struct sockaddr_ll addr;
+    struct iovec iov = { .iov_base = frame, .iov_len = sizeof(frame) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct pollfd pfd = { .fd = capture->fd, .events = POLLIN };
+    struct timespec ts;
+    ssize_t size;
+
+    while (__atomic_load_n(&capture->running, __ATOMIC_RELAXED)) {
+        /* Timeout needed to periodically check `running` */
+        if (poll(&pfd, 1, 100) <= 0) {
+            continue;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &addr;
+        msg.msg_namelen = sizeof(addr);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        size = recvmsg(capture->fd, &msg, 0);
+        if (size <= 0) {
+            continue;
+        }
+
+        /* Prefer the kernel timestamp, if provided */
+        clock_gettime(CLOCK_REALTIME, &ts);
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS) {
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+            }
+        }
+
+        pcapng_write_packet(capture->file,
+                            (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec,
+                            frame, size, addr.sll_pkttype == PACKET_OUTGOING);
+        ++capture->frames;
+    }
+
+    return NULL;
+}
+
+/**
+ * capture_start:
+ * @capture: a Capture instance
+ * @iface:   the interface to capture
+ * @path:    where to save the pcapng file, or NULL to not capture
+ *
+ * Start a thread that saves into @path all the EtherCAT frames
+ * transmitted and received on @iface, with kernel timestamps. The
+ * capture adds some overhead to the network stack: the frames must be
+ * cloned and passed to the capture socket.
+ *
+ * Returns: FALSE on errors.
+ */
+int
+capture_start(Capture *capture, const char *iface, const char *path)
+{
+    /* Outgoing frames are passed only to ETH_P_ALL sockets, so use
+     * one with a filter on the EtherCAT ethertype */
+    struct sock_filter code[] = {
+        BPF_STMT(BPF_LD | BPF_H | BPF_ABS, 12),
+        BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ETHERCAT_ETHERTYPE, 0, 1),
+        BPF_STMT(BPF_RET | BPF_K, 0xFFFF),
+        BPF_STMT(BPF_RET | BPF_K, 0),
+    };
+    struct sock_fprog filter = {
+        .len = sizeof(code) / sizeof(code[0]),
+        .filter = code,
+    };
+    struct sockaddr_ll addr;
+    int enable = 1;
+
+    memset(capture, 0, sizeof(*capture));
+    capture->fd = -1;
+    if (path == NULL) {
+        return TRUE;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = iface != NULL ? if_nametoindex(iface) : 0;
+    if (addr.sll_ifindex == 0) {
+        info("Invalid capture interface '%s'\n", iface != NULL ? iface : "");
+        return FALSE;
+    }
+
+    capture->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (capture->fd < 0 ||
+        setsockopt(capture->fd, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter)) != 0 ||
+        bind(capture->fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        info("Unable to capture on '%s': %s\n", iface, strerror(errno));
+        goto error;
+    }
+    setsockopt(capture->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+
+    capture->file = fopen(path, "w");
+    if (capture->file == NULL) {
+        info("Unable to open '%s': %s\n", path, strerror(errno));
+        goto error;
+    }
+    if (! pcapng_write_header(capture->file, iface)) {
+        info("Unable to write to '%s'\n", path);
+        goto error;
+    }
+
+    capture->running = TRUE;
+    if (pthread_create(&capture->thread, NULL, capture_thread, capture) != 0) {
+        info("Unable to start the capture thread\n");
+        capture->running = FALSE;
+        goto error;
+    }
+    return TRUE;
+
+error:
+    if (capture->file != NULL) {
+        fclose(capture->file);
+        capture->file = NULL;
+    }
+    if (capture->fd >= 0) {
+        close(capture->fd);
+        capture->fd = -1;
+    }
+    return FALSE;
+}
+
+void
+capture_stop(Capture *capture)
+{
+    if (capture->file == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&capture->running, FALSE, __ATOMIC_RELAXED);
+    pthread_join(capture->thread, NULL);
+    fclose(capture->file);
+    close(capture->fd);
+    capture->file = NULL;
+    capture->fd = -1;
+    info("%" PRIu64 " frames captured\n", capture->frames);
+}
+
+void
+stats_reset(Stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+}
+
+void
+stats_add(Stats *stats, int64_t value)
+{
+    if (stats->iterations == 0 || value < stats->min) {
+        stats->min = value;
+    }
+    if (stats->iterations == 0 || value > stats->max) {
+        stats->max = value;
+    }
+    stats->total += value;
+    ++stats->iterations;
+    ++stats->histogram[stats_bucket(value)];
+}
+
+/**
+ * stats_percentile:
+ * @stats:      a Stats instance
+ * @percentile: the percentile to compute, between 0 and 100
+ *
+ * Compute an estimation of @percentile from the histogram. The result
+ * is the upper bound of the matching bucket, clamped to the real
+ * min/max range.
+ *
+ * Returns: the computed value or 0 if @stats is empty.
+ */
+int64_t
+stats_percentile(const Stats *stats, double percentile)
+{
+    uint64_t rank, count;
+    int64_t value;
+    int n;
+
+    if (stats->iterations == 0) {
+        return 0;
+    }
+
+    rank = (uint64_t) (stats->iterations * percentile / 100. + 0.5);
+    if (rank < 1) {
+        rank = 1;
+    }
+
+    count = 0;
+    for (n = 0; n < STATS_BUCKETS; ++n) {
+        count += stats->histogram[n];
+        if (count >= rank) {
+            break;
+        }
+    }
+
+    value = stats_bucket_upper(n);
+    if (value > stats->max) {
+        value = stats->max;
+    } else if (value < stats->min) {
+        value = stats->min;
+    }
+    return value;
+}
+
+/**
+ * metrics_open:
+ * @name:     name of the shared memory segment, without the leading slash
+ * @writable: TRUE to create the segment (publisher side), FALSE to map
+ *            an existing one read-only (viewer side)
+ *
+ * Map the metrics segment of @name, `/dev/shm/ethercatest-@name` on
+ * Linux. The segment is not removed at exit, so the final metrics can
+ * still be inspected after the run.
+ *
+ * Returns: the mapped metrics or NULL on errors.
+ */
+Metrics *
+metrics_open(const char *name, int writable)
+{
+    char path[NAME_MAX];
+    Metrics *metrics;
+    int fd;
+
+    snprintf(path, sizeof(path), "/ethercatest-%s", name);
+    fd = shm_open(path, writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+    if (fd < 0) {
+        info("Unable to open '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (writable && ftruncate(fd, sizeof(Metrics)) != 0) {
+        info("Unable to resize '%s': %s\n", path, strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    metrics = mmap(NULL, sizeof(Metrics),
+                   writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                   MAP_SHARED, fd, 0);
+    close(fd);
+    if (metrics == MAP_FAILED) {
+        info("Unable to map '%s': %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    if (writable) {
+        /* Also prefaults the pages, so the loop will not fault on them */
+        memset(metrics, 0, sizeof(Metrics));
+        metrics->pid = getpid();
+    }
+    return metrics;
+}
+
+static void
+metrics_write_begin(Metrics *metrics)
+{
+    __atomic_store_n(&metrics->sequence, metrics->sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void
+metrics_write_end(Metrics *metrics)
+{
+    __atomic_store_n(&metrics->sequence, metrics->sequence + 1, __ATOMIC_RELEASE);
+}
+
+/* Get a consistent copy of `metrics`, retrying while it is updated.
+ * Returns FALSE if the publisher died (or stopped) in the middle of an
+ * update, leaving the sequence odd */
+int
+metrics_read(const Metrics *metrics, Metrics *snapshot)
+{
+    uint32_t sequence;
+    int n;
+
+    for (n = 0; n < METRICS_READ_RETRIES; ++n) {
+        sequence = __atomic_load_n(&metrics->sequence, __ATOMIC_ACQUIRE);
+        if ((sequence & 1) == 0) {
+            memcpy(snapshot, metrics, sizeof(*snapshot));
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&metrics->sequence, __ATOMIC_RELAXED) == sequence) {
+                return TRUE;
+            }
+        } else if (kill(metrics->pid, 0) != 0 && errno == ESRCH) {
+            break;
+        }
+        sched_yield();
+    }
+    return FALSE;
+}
+
+/**
+ * report_initialize:
+ * @report:  a Report instance
+ * @stack:   name of the EtherCAT stack
+ * @options: the parsed options
+ *
+ * Initialize @report and check the platform, locking the memory and
+ * opening the metrics segment when requested by @options.
+ *
+ * Returns: FALSE if the clock, the memory locking (with `--memcheck`)
+ * or the metrics segment are not usable.
+ */
+int
+report_initialize(Report *report, const char *stack, const Options *options)
+{
+    Metrics *metrics;
+
+    memset(report, 0, sizeof(*report));
+    report->stack = stack;
+    report->label = options->label != NULL ? options->label : "";
+    report->interference = options->interference != NULL ? options->interference : "";
+    stats_reset(&report->stats);
+    report->reaction.send_ahead = options->send_ahead;
+    /* Wait as much as possible until the roundtrip is known: polling,
+     * this costs time only when a frame is lost */
+    report->reaction.lead = 1000000;
+    report->reaction.max_lead = 1000000;
+    report->links = 1;
+    report->fault.iface = options->break_iface;
+    report->fault.at = options->break_at;
+    report->fault.duration = options->break_duration;
+    if (! platform_check(&report->platform, options->tsc)) {
+        return FALSE;
+    }
+    platform_dump(&report->platform);
+    /* Without resident memory, counting the page faults is pointless */
+    if (options->memcheck && ! memcheck_prepare()) {
+        return FALSE;
+    }
+    /* The startup phases are measured from here: the platform checks
+     * (the TSC calibration above all) and the memory locking would
+     * otherwise weigh on the first phase, more on slower targets */
+    report->start_time = get_monotonic_time();
+
+    if (options->publish != NULL) {
+        metrics = metrics_open(options->publish, TRUE);
+        if (metrics == NULL) {
+            return FALSE;
+        }
+        snprintf(metrics->stack, sizeof(metrics->stack), "%s", report->stack);
+        snprintf(metrics->label, sizeof(metrics->label), "%s", report->label);
+        report->metrics = metrics;
+    }
+
+    return TRUE;
+}
+
+/* Remove from @elapsed the cost of the timestamp that closed it */
+static int64_t
+report_elapsed(const Report *report, int64_t elapsed)
+{
+    elapsed -= report->platform.read_cost;
+    return elapsed > 0 ? elapsed : 0;
+}
+
+/* Failed iterations since the break, up to the recovery if any */
+static uint32_t
+fault_get_lost(const Fault *fault, const Report *report)
+{
+    if (fault->broken == 0) {
+        return 0;
+    } else if (fault->recovered == 0) {
+        return report->errors - fault->errors_before + fault->failed;
+    }
+    return fault->lost;
+}
+
+/**
+ * report_phase:
+ * @report: a Report instance
+ * @name:   name of the startup phase just completed
+ *
+ * Record the time elapsed between the start of @report and the
+ * completion of the @name startup phase. @name must be a static string.
+ */
+void
+report_phase(Report *report, const char *name)
+{
+    Phase *phase;
+
+    if (report == NULL || report->nphases >= REPORT_MAX_PHASES) {
+        return;
+    }
+
+    phase = report->phases + report->nphases;
+    phase->name = name;
+    phase->time = report_elapsed(report, get_monotonic_time() - report->start_time);
+    ++report->nphases;
+}
+
+/**
+ * report_add:
+ * @report: a Report instance
+ * @time:   the iteration time in nsec, as measured
+ *
+ * Account a new iteration in the current window, net of the cost of
+ * the timestamp, also for the cable break and, if a metrics segment is
+ * open, the published counters: this must be called after updating
+ * the error counters of @report.
+ */
+void
+report_add(Report *report, int64_t time)
+{
+    Metrics *metrics = report->metrics;
+
+    time = report_elapsed(report, time);
+    stats_add(&report->stats, time);
+    if (report->fault.iface != NULL) {
+        fault_account(&report->fault, report, time);
+    }
+
+    if (metrics != NULL) {
+        metrics_write_begin(metrics);
+        metrics->last = time;
+        metrics->errors = report->errors;
+        metrics->wkc_errors = report->wkc_errors;
+        metrics->overruns = report->scheduler.overruns;
+        metrics->missed_slots = report->scheduler.missed_slots;
+        stats_add(&metrics->stats, time);
+        metrics_write_end(metrics);
+    }
+}
+
+void
+report_dump(const Report *report)
+{
+    const Stats *stats = &report->stats;
+    const Scheduler *scheduler = &report->scheduler;
+    const Stats *reaction = &report->reaction.time;
+    const Fault *fault = &report->fault;
+
+    info("\nIteration time (usec): min %.3f  max %.3f  total %.3f  errors %" PRIu32 "\n",
+         USEC(stats->min), USEC(stats->max), USEC(stats->total), report->errors);
+    info("Percentiles (usec): p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  wkc-errors %" PRIu32 "\n",
+         USEC(stats_percentile(stats, 50)), USEC(stats_percentile(stats, 90)),
+         USEC(stats_percentile(stats, 99)), USEC(stats_percentile(stats, 99.9)),
+         report->wkc_errors);
+    info("Overruns (%s): %" PRIu64 "  missed slots %" PRIu64 "  bursts %" PRIu64 "  longest burst %" PRIu64 "\n",
+         overrun_policies[scheduler->policy], scheduler->overruns,
+         scheduler->missed_slots, scheduler->bursts, scheduler->longest_burst);
+    info("Reaction time (usec): p50 %.3f  p99 %.3f  max %.3f",
+         USEC(stats_percentile(reaction, 50)), USEC(stats_percentile(reaction, 99)),
+         USEC(reaction->max));
+    if (report->reaction.send_ahead) {
+        info("  refresh roundtrip p50 %.3f  p99 %.3f  late %" PRIu64,
+             USEC(stats_percentile(&report->reaction.roundtrip, 50)),
+             USEC(stats_percentile(&report->reaction.roundtrip, 99)),
+             report->reaction.misses);
+    }
+    info("\n");
+    if (report->mailbox != NULL && report->mailbox->options->sdo_rate > 0) {
+        const Mailbox *mailbox = report->mailbox;
+        info("Mailbox (%ld Hz, 0x%04X:%u): transactions %" PRIu64 "  errors %" PRIu64
+             "  latency (usec) p50 %.3f  p99 %.3f  max %.3f\n",
+             mailbox->options->sdo_rate, mailbox->options->sdo_index,
+             mailbox->options->sdo_subindex, mailbox->latency.iterations,
+             mailbox->errors, USEC(stats_percentile(&mailbox->latency, 50)),
+             USEC(stats_percentile(&mailbox->latency, 99)), USEC(mailbox->latency.max));
+    }
+    info("Memory: allocations %" PRIu64 "  minor faults %" PRIu64 "  major faults %" PRIu64 "\n",
+         report->memory.allocations, report->memory.minor_faults,
+         report->memory.major_faults);
+    info("Links: %d  redundancy active %" PRIu64 " iterations\n",
+         report->links, report->redundancy_active);
+    if (fault->iface != NULL) {
+        info("Cable break (%s at %.3f msec", fault->iface, fault->at / 1000000.);
+        if (fault->duration > 0) {
+            info(" for %.3f msec", fault->duration / 1000000.);
+        }
+        info("): ");
+        if (fault->broken == 0) {
+            info("not happened\n");
+        } else if (fault->recovered == 0) {
+            info("lost %" PRIu32 "  never recovered\n", fault_get_lost(fault, report));
+        } else {
+            info("lost %" PRIu32 "  recovery %.3f usec\n", fault->lost,
+                 USEC(fault->recovered - fault->broken));
+        }
+        info("Before/during break (usec): p50 %.3f/%.3f  p99 %.3f/%.3f  max %.3f/%.3f\n",
+             USEC(stats_percentile(&fault->before, 50)),
+             USEC(stats_percentile(&fault->during, 50)),
+             USEC(stats_percentile(&fault->before, 99)),
+             USEC(stats_percentile(&fault->during, 99)),
+             USEC(fault->before.max), USEC(fault->during.max));
+    }
+}
+
+/**
+ * report_begin_window:
+ * @report:  a Report instance
+ * @options: the parsed options
+ * @window:  the window to begin, -1 for the warm-up
+ *
+ * Prepare @report for a new measurement window, applying the
+ * scheduling of the relevant sweep item (if any). The warm-up uses the
+ * same scheduling of the first window.
+ *
+ * Returns: FALSE if the scheduling cannot be applied.
+ */
+int
+report_begin_window(Report *report, const Options *options, int window)
+{
+    if (options->nsweep > 0 &&
+        ! sched_apply(options->sweep + (window < 0 ? 0 : window))) {
+        return FALSE;
+    }
+
+    report->window = window;
+    report->errors = 0;
+    report->wkc_errors = 0;
+    report->redundancy_active = 0;
+    stats_reset(&report->stats);
+    scheduler_initialize(&report->scheduler, report->period * 1000, options->overrun);
+    if (report->period > 0) {
+        report->reaction.max_lead = report->period * 1000 / 2;
+        if (report->reaction.lead > report->reaction.max_lead) {
+            report->reaction.lead = report->reaction.max_lead;
+        }
+    }
+    report->reaction.late = FALSE;
+    report->reaction.misses = 0;
+    stats_reset(&report->reaction.roundtrip);
+    stats_reset(&report->reaction.time);
+
+    if (report->mailbox != NULL) {
+        pthread_mutex_lock(&report->mailbox->mutex);
+        report->mailbox->errors = 0;
+        stats_reset(&report->mailbox->latency);
+        pthread_mutex_unlock(&report->mailbox->mutex);
+    }
+
+    if (report->metrics != NULL) {
+        Metrics *metrics = report->metrics;
+        metrics_write_begin(metrics);
+        metrics->period = report->period;
+        metrics->window = window;
+        metrics->last = 0;
+        metrics->errors = 0;
+        metrics->wkc_errors = 0;
+        metrics->overruns = 0;
+        metrics->missed_slots = 0;
+        stats_reset(&metrics->stats);
+        metrics_write_end(metrics);
+    }
+
+    /* The cable break is not simulated in the warm-up */
+    if (window >= 0 && ! fault_start(&report->fault)) {
+        return FALSE;
+    }
+
+    /* Must be the last thing, to leave out the above code */
+    memcheck_sample(&report->memory_start);
+    return TRUE;
+}
+
+/**
+ * report_end_window:
+ * @report:  a Report instance
+ * @options: the parsed options
+ *
+ * Close the current measurement window: dump the results and, if
+ * requested, append them to the output file. Nothing is done for
+ * the warm-up window.
+ *
+ * Returns: FALSE if the record cannot be written or, with the memory
+ *          check enabled, if the loop allocated or faulted.
+ */
+int
+report_end_window(Report *report, const Options *options)
+{
+    Mailbox *mailbox = report->mailbox;
+    MemoryUsage *memory = &report->memory;
+    int result;
+
+    /* Must be the first thing, to leave out the below code */
+    memcheck_sample(memory);
+    memory->allocations -= report->memory_start.allocations;
+    memory->minor_faults -= report->memory_start.minor_faults;
+    memory->major_faults -= report->memory_start.major_faults;
+
+    fault_stop(&report->fault);
+    if (report->window < 0) {
+        return TRUE;
+    }
+
+    /* Keep the mailbox statistics still while dumping them */
+    if (mailbox != NULL) {
+        pthread_mutex_lock(&mailbox->mutex);
+    }
+    report_dump(report);
+    result = report_write(report, options->output);
+    if (mailbox != NULL) {
+        pthread_mutex_unlock(&mailbox->mutex);
+    }
+
+    if (options->memcheck && (memory->allocations > 0 ||
+                              memory->minor_faults > 0 ||
+                              memory->major_faults > 0)) {
+        info("Memory check failed: the loop is not allocation and fault free\n");
+        result = FALSE;
+    }
+
+    return result;
+}
+
+static const char *
+get_policy_name(int policy)
+{
+    size_t n;
+
+    for (n = 0; n < sizeof(policies) / sizeof(policies[0]); ++n) {
+        if (policies[n].policy == policy) {
+            return policies[n].name;
+        }
+    }
+    return "unknown";
+}
+
+/* Write `text` as a quoted string, escaped for CSV or JSON */
+static void
+write_string(FILE *file, const char *text, int json)
+{
+    const char *p;
+
+    fputc('"', file);
+    for (p = text; *p != '\0'; ++p) {
+        if (*p == '"') {
+            fputs(json ? "\\\"" : "\"\"", file);
+        } else if (json && *p == '\\') {
+            fputs("\\\\", file);
+        } else if ((unsigned char) *p < ' ') {
+            fputc(' ', file);
+        } else {
+            fputc(*p, file);
+        }
+    }
+    fputc('"', file);
+}
+
+typedef struct {
+    const char *    key;
+    int             is_string;
+    const char *    string;
+    int64_t         number;
+} Field;
+
+#define STRING_FIELD(k,v)   { .key = k, .is_string = TRUE, .string = (v) }
+#define NUMBER_FIELD(k,v)   { .key = k, .is_string = FALSE, .number = (v) }
+
+/* Check whether the first line of @file is the CSV header of @fields:
+ * an empty file has no header yet and is considered a match */
+static int
+csv_header_matches(FILE *file, const Field *fields, size_t nfields, int *empty)
+{
+    const char *key;
+    size_t n;
+    int ch;
+
+    rewind(file);
+    ch = getc(file);
+    *empty = ch == EOF;
+    if (*empty) {
+        return TRUE;
+    }
+    ungetc(ch, file);
+
+    for (n = 0; n < nfields; ++n) {
+        if (n > 0 && getc(file) != ',') {
+            return FALSE;
+        }
+        for (key = fields[n].key; *key != '\0'; ++key) {
+            if (getc(file) != *key) {
+                return FALSE;
+            }
+        }
+    }
+    ch = getc(file);
+    return ch == '\n' || ch == '\r';
+}
+
+/**
+ * report_write:
+ * @report: a Report instance
+ * @path:   the file where to append the record
+ *
+ * Append to @path a machine readable record with the results of the
+ * run, the startup phases and information about the host. If @path
+ * ends with `.json`, the record is a single line JSON object (so the
+ * file is in JSON Lines format), otherwise it is a CSV row. The CSV
+ * header is written only when @path is empty, so records of different
+ * runs (and hosts) can be safely accumulated in the same file. If the
+ * existing header differs (e.g. the file was written by a different
+ * version), nothing is appended because the columns would not match.
+ * The times are in nsec, the period in usec.
+ *
+ * Returns: TRUE on success, FALSE on errors.
+ */
+int
+report_write(const Report *report, const char *path)
+{
+    const Stats *stats = &report->stats;
+    const Scheduler *scheduler = &report->scheduler;
+    const NicSettings *nic = &report->nic;
+    const Mailbox *mailbox = report->mailbox;
+    const Fault *fault = &report->fault;
+    Stats no_latency;
+    struct utsname host;
+    struct sched_param param;
+    char timestamp[32], phases[REPORT_MAX_PHASES * 32];
+    time_t now;
+    size_t len, n;
+    int json, niceness, policy;
+    FILE *file;
+
+    if (path == NULL) {
+        return TRUE;
+    }
+
+    len = strlen(path);
+    json = len > 5 && strcmp(path + len - 5, ".json") == 0;
+
+    if (uname(&host) < 0) {
+        memset(&host, 0, sizeof(host));
+    }
+    now = time(NULL);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+    errno = 0;
+    niceness = getpriority(PRIO_PROCESS, 0);
+    if (errno != 0) {
+        niceness = 0;
+    }
+    policy = sched_getscheduler(0);
+    if (sched_getparam(0, &param) < 0) {
+        param.sched_priority = 0;
+    }
+
+    /* Phases are flattened in a single "name=nsec;..." string
+     * to keep a fixed number of CSV columns */
+    phases[0] = '\0';
+    len = 0;
+    for (n = 0; n < (size_t) report->nphases && len < sizeof(phases); ++n) {
+        len += snprintf(phases + len, sizeof(phases) - len, "%s%s=%" PRId64,
+                        n == 0 ? "" : ";", report->phases[n].name,
+                        report->phases[n].time);
+    }
+
+    if (mailbox == NULL || mailbox->options->sdo_rate <= 0) {
+        stats_reset(&no_latency);
+        mailbox = NULL;
+    }
+    const Stats *sdo = mailbox != NULL ? &mailbox->latency : &no_latency;
+
+    Field fields[] = {
+        STRING_FIELD("timestamp",     timestamp),
+        STRING_FIELD("host",          host.nodename),
+        STRING_FIELD("kernel",        host.release),
+        STRING_FIELD("machine",       host.machine),
+        NUMBER_FIELD("cpus",          sysconf(_SC_NPROCESSORS_ONLN)),
+        NUMBER_FIELD("cache_line",    report->platform.cache_line),
+        STRING_FIELD("clock_source",  report->platform.clock_source),
+        NUMBER_FIELD("clock_res",     report->platform.clock_resolution),
+        NUMBER_FIELD("clock_step",    report->platform.clock_step),
+        NUMBER_FIELD("clock_cost",    report->platform.clock_cost),
+        NUMBER_FIELD("syscall_cost",  report->platform.syscall_cost),
+        NUMBER_FIELD("tsc_khz",       report->platform.tsc_frequency),
+        NUMBER_FIELD("tsc_cost",      report->platform.tsc_cost),
+        STRING_FIELD("time_source",   report->platform.tsc ? "tsc" : "clock"),
+        NUMBER_FIELD("read_cost",     report->platform.read_cost),
+        STRING_FIELD("stack",         report->stack),
+        STRING_FIELD("label",         report->label),
+        STRING_FIELD("interference",  report->interference),
+        NUMBER_FIELD("window",        report->window),
+        NUMBER_FIELD("period",        report->period),
+        NUMBER_FIELD("niceness",      niceness),
+        STRING_FIELD("policy",        get_policy_name(policy)),
+        NUMBER_FIELD("priority",      param.sched_priority),
+        NUMBER_FIELD("iterations",    stats->iterations),
+        NUMBER_FIELD("min",           stats->min),
+        NUMBER_FIELD("p50",           stats_percentile(stats, 50)),
+        NUMBER_FIELD("p90",           stats_percentile(stats, 90)),
+        NUMBER_FIELD("p99",           stats_percentile(stats, 99)),
+        NUMBER_FIELD("p999",          stats_percentile(stats, 99.9)),
+        NUMBER_FIELD("max",           stats->max),
+        NUMBER_FIELD("total",         stats->total),
+        NUMBER_FIELD("errors",        report->errors),
+        NUMBER_FIELD("wkc_errors",    report->wkc_errors),
+        STRING_FIELD("overrun",       overrun_policies[scheduler->policy]),
+        NUMBER_FIELD("overruns",      scheduler->overruns),
+        NUMBER_FIELD("missed_slots",  scheduler->missed_slots),
+        NUMBER_FIELD("bursts",        scheduler->bursts),
+        NUMBER_FIELD("longest_burst", scheduler->longest_burst),
+        NUMBER_FIELD("send_ahead",    report->reaction.send_ahead),
+        NUMBER_FIELD("reaction_p50",  stats_percentile(&report->reaction.time, 50)),
+        NUMBER_FIELD("reaction_p99",  stats_percentile(&report->reaction.time, 99)),
+        NUMBER_FIELD("reaction_max",  report->reaction.time.max),
+        NUMBER_FIELD("roundtrip_p99", stats_percentile(&report->reaction.roundtrip, 99)),
+        NUMBER_FIELD("refresh_misses", report->reaction.misses),
+        NUMBER_FIELD("sdo_rate",      mailbox != NULL ? mailbox->options->sdo_rate : 0),
+        NUMBER_FIELD("sdo_transactions", sdo->iterations),
+        NUMBER_FIELD("sdo_errors",    mailbox != NULL ? (int64_t) mailbox->errors : 0),
+        NUMBER_FIELD("sdo_p50",       stats_percentile(sdo, 50)),
+        NUMBER_FIELD("sdo_p99",       stats_percentile(sdo, 99)),
+        NUMBER_FIELD("sdo_max",       sdo->max),
+        NUMBER_FIELD("allocations",   report->memory.allocations),
+        NUMBER_FIELD("minor_faults",  report->memory.minor_faults),
+        NUMBER_FIELD("major_faults",  report->memory.major_faults),
+        NUMBER_FIELD("links",         report->links),
+        NUMBER_FIELD("redundancy_active", report->redundancy_active),
+        STRING_FIELD("break_iface",   fault->iface != NULL ? fault->iface : ""),
+        NUMBER_FIELD("break_at",      fault->iface != NULL ? fault->at : -1),
+        NUMBER_FIELD("break_lost",    fault_get_lost(fault, report)),
+        NUMBER_FIELD("break_recovery", fault->recovered > 0 ? fault->recovered - fault->broken : -1),
+        NUMBER_FIELD("before_p50",    stats_percentile(&fault->before, 50)),
+        NUMBER_FIELD("before_p99",    stats_percentile(&fault->before, 99)),
+        NUMBER_FIELD("during_p50",    stats_percentile(&fault->during, 50)),
+        NUMBER_FIELD("during_p99",    stats_percentile(&fault->during, 99)),
+        NUMBER_FIELD("during_max",    fault->during.max),
+        STRING_FIELD("phases",        phases),
+        STRING_FIELD("iface",         nic->iface),
+        NUMBER_FIELD("rx_usecs",      nic->rx_usecs),
+        NUMBER_FIELD("rx_frames",     nic->rx_frames),
+        NUMBER_FIELD("tx_usecs",      nic->tx_usecs),
+        NUMBER_FIELD("tx_frames",     nic->tx_frames),
+        NUMBER_FIELD("adaptive_rx",   nic->adaptive_rx),
+        NUMBER_FIELD("adaptive_tx",   nic->adaptive_tx),
+        NUMBER_FIELD("rx_ring",       nic->rx_ring),
+        NUMBER_FIELD("tx_ring",       nic->tx_ring),
+        NUMBER_FIELD("gro",           nic->gro),
+        NUMBER_FIELD("gso",           nic->gso),
+        NUMBER_FIELD("tso",           nic->tso),
+        NUMBER_FIELD("rx_csum",       nic->rx_csum),
+        NUMBER_FIELD("tx_csum",       nic->tx_csum),
+    };
+    size_t nfields = sizeof(fields) / sizeof(fields[0]);
+
+    file = fopen(path, json ? "a" : "a+");
+    if (file == NULL) {
+        info("Unable to open '%s'\n", path);
+        return FALSE;
+    }
+
+    if (json) {
+        fputc('{', file);
+        for (n = 0; n < nfields; ++n) {
+            fprintf(file, "%s\"%s\": ", n == 0 ? "" : ", ", fields[n].key);
+            if (fields[n].is_string) {
+                write_string(file, fields[n].string, TRUE);
+            } else {
+                fprintf(file, "%" PRId64, fields[n].number);
+            }
+        }
+        fputs("}\n", file);
+    } else {
+        int empty;
+        if (! csv_header_matches(file, fields, nfields, &empty)) {
+            info("'%s' has different columns: use a new file\n", path);
+            fclose(file);
+            return FALSE;
+        }
+        /* Writes go to the end anyway, but a seek is required
+         * when switching from reading to writing */
+        fseek(file, 0, SEEK_END);
+        if (empty) {
+            for (n = 0; n < nfields; ++n) {
+                fprintf(file, "%s%s", n == 0 ? "" : ",", fields[n].key);
+            }
+            fputc('\n', file);
+        }
+        for (n = 0; n < nfields; ++n) {
+            if (n > 0) {
+                fputc(',', file);
+            }
+            if (fields[n].is_string) {
+                write_string(file, fields[n].string, FALSE);
+            } else {
+                fprintf(file, "%" PRId64, fields[n].number);
+            }
+        }
+        fputc('\n', file);
+    }
+
+    return fclose(file) == 0;
+}
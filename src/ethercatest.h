@@ -17,15 +17,388 @@
  * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
  */
 
+#include <net/if.h>
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/types.h>
 
 #define info  printf
 #define FALSE 0
 #define TRUE  1
+/* Times are measured in nsec but shown in usec */
+#define USEC(nsec)  ((nsec) / 1000.)
+
+/* Log-linear histogram: values below 2 << STATS_SUB_BITS are
+ * stored exactly, the others with a relative error below
+ * 1 / (1 << STATS_SUB_BITS) */
+#define STATS_SUB_BITS      6
+#define STATS_BUCKETS       ((64 - STATS_SUB_BITS) << STATS_SUB_BITS)
+#define REPORT_MAX_PHASES   16
+#define OPTIONS_MAX_SWEEP   64
+#define ETHERCAT_ETHERTYPE  0x88A4
+
+/* pcapng blocks, see https://www.ietf.org/archive/id/draft-ietf-opsawg-pcapng-03.html */
+#define PCAPNG_SHB          0x0A0D0D0A
+#define PCAPNG_IDB          0x00000001
+#define PCAPNG_EPB          0x00000006
+#define PCAPNG_BYTE_ORDER   0x1A2B3C4D
+#define PCAPNG_LINKTYPE_ETHERNET    1
+#define PCAPNG_OPT_END      0
+#define PCAPNG_IF_NAME      2
+#define PCAPNG_IF_TSRESOL   9
+#define PCAPNG_EPB_FLAGS    2
+
+
+/* What to do when an iteration does not complete within its slot */
+typedef enum {
+    /* Sleep for the period minus the iteration time, with no notion
+     * of slots: an overrun just delays all the subsequent iterations */
+    OVERRUN_RELATIVE,
+    /* Drop the missed slots and wait for the next slot boundary */
+    OVERRUN_SKIP,
+    /* Run the missed iterations back to back until on time again */
+    OVERRUN_CATCHUP,
+    /* Start the next iteration immediately, then go back to the
+     * original slot grid dropping the missed slots: unlike skip, the
+     * late iteration is not delayed and, unlike a restart of the grid
+     * from now, the phase of the cycle does not change */
+    OVERRUN_REALIGN,
+} OverrunPolicy;
+
+/* A scheduling policy with its niceness (for SCHED_OTHER, SCHED_BATCH
+ * and SCHED_IDLE) or its static priority (for SCHED_FIFO and SCHED_RR) */
+typedef struct {
+    int             policy;
+    int             value;
+} SchedSpec;
+
+/* Options shared by all the test programs */
+typedef struct {
+    const char *    nic_profile;
+    const char *    output;
+    const char *    label;
+    const char *    interference;
+    uint64_t        iterations;
+    uint64_t        warmup;
+    OverrunPolicy   overrun;
+    /* Mailbox traffic: rate in Hz and CoE object to access. The
+     * object is written back after the read only if explicitly set */
+    long            sdo_rate;
+    uint16_t        sdo_index;
+    uint8_t         sdo_subindex;
+    int             sdo_write;
+    /* Lock the memory and fail if the loop allocates or faults */
+    int             memcheck;
+    /* Name of the shared memory segment where to publish the metrics */
+    const char *    publish;
+    /* Refresh the inputs with an additional frame before computing
+     * the outputs, instead of using the ones read in the last cycle */
+    int             send_ahead;
+    /* pcapng file where to save the EtherCAT traffic */
+    const char *    capture;
+    /* Use the TSC instead of CLOCK_MONOTONIC for the timestamps */
+    int             tsc;
+    /* Simulated cable break: interface to bring down, when (since the
+     * start of every window) and for how long (0 for the whole rest
+     * of the window), in nsec */
+    const char *    break_iface;
+    int64_t         break_at;
+    int64_t         break_duration;
+    int             nsweep;
+    SchedSpec       sweep[OPTIONS_MAX_SWEEP];
+} Options;
+
+/* NIC parameters that can affect the roundtrip time. Any value that
+ * cannot be read from the driver is set to -1. */
+typedef struct {
+    char            iface[IF_NAMESIZE];
+    int64_t         rx_usecs;
+    int64_t         rx_frames;
+    int64_t         tx_usecs;
+    int64_t         tx_frames;
+    int64_t         adaptive_rx;
+    int64_t         adaptive_tx;
+    int64_t         rx_ring;
+    int64_t         tx_ring;
+    int64_t         gro;
+    int64_t         gso;
+    int64_t         tso;
+    int64_t         rx_csum;
+    int64_t         tx_csum;
+} NicSettings;
+
+typedef struct {
+    uint64_t        iterations;
+    int64_t         min;
+    int64_t         max;
+    int64_t         total;
+    uint32_t        histogram[STATS_BUCKETS];
+} Stats;
+
+typedef struct {
+    const char *    name;
+    int64_t         time;
+} Phase;
+
+typedef struct {
+    int64_t         period;
+    OverrunPolicy   policy;
+    /* Start of the next slot */
+    int64_t         next;
+    /* Last slot boundary accounted as missed */
+    int64_t         last_missed;
+    /* Iterations that did not complete within their slot */
+    uint64_t        overruns;
+    /* Slot boundaries passed while an iteration was still running */
+    uint64_t        missed_slots;
+    /* Sequences of consecutive overruns */
+    uint64_t        bursts;
+    uint64_t        burst;
+    uint64_t        longest_burst;
+} Scheduler;
+
+/* I/O reaction time: from the transmission of the frame that sampled
+ * the inputs to the transmission of the frame carrying the outputs
+ * computed from them (the wire latencies cancel out). */
+typedef struct {
+    int             send_ahead;
+    /* Last frame transmission */
+    int64_t         last_send;
+    /* Send-ahead only: how long to poll for the refresh frame when the
+     * stack cannot block on it: a high percentile of the roundtrip plus
+     * a margin, never below the longest roundtrip seen */
+    int64_t         lead;
+    int64_t         max_lead;
+    /* Send-ahead only: lower bound of the lead, raised by late frames */
+    int64_t         min_lead;
+    /* Send-ahead only: whether the last refresh frame was late or lost,
+     * i.e. its reaction time was not measured, and how many were. The
+     * iteration still counts as a working counter error, if any */
+    int             late;
+    uint64_t        misses;
+    /* Send-ahead only: time from refresh transmission to reception */
+    Stats           roundtrip;
+    Stats           time;
+} Reaction;
+
+/* Performs a single mailbox transaction (e.g. a CoE SDO read). It is
+ * called by the mailbox thread, concurrently to the cyclic loop. */
+typedef int (*MailboxCallback)(void *data, const Options *options);
+
+typedef struct {
+    MailboxCallback callback;
+    void *          data;
+    const Options * options;
+    pthread_t       thread;
+    pthread_mutex_t mutex;
+    int             running;
+    /* TRUE while a transaction is in progress */
+    int             busy;
+    uint64_t        errors;
+    Stats           latency;
+} Mailbox;
+
+/* Heap allocations and page faults of the thread running the loop */
+typedef struct {
+    uint64_t        allocations;
+    uint64_t        minor_faults;
+    uint64_t        major_faults;
+} MemoryUsage;
+
+/* Simulated cable break, performed by a separate thread so the loop
+ * only sees its effects. The loop splits its iteration times in before
+ * and during the break, and measures how long the stack takes to
+ * complete again an iteration with the expected working counter. */
+typedef struct {
+    const char *    iface;
+    int64_t         at;
+    int64_t         duration;
+    pthread_t       thread;
+    int             running;
+    /* Start of the current window, also read with CLOCK_MONOTONIC
+     * for the timers when the TSC is the time source */
+    int64_t         start;
+    int64_t         timer_start;
+    /* When the link went down and up again, 0 if not (yet) happened */
+    int64_t         broken;
+    int64_t         restored;
+    /* Completion of the first good iteration after the break */
+    int64_t         recovered;
+    /* Iteration errors before the break, working counter errors up to
+     * the last iteration */
+    uint32_t        errors_before;
+    uint32_t        wkc_errors_seen;
+    /* Completed iterations not ok (working counter error or late
+     * refresh frame) since the break */
+    uint32_t        failed;
+    /* Failed iterations between the break and the recovery */
+    uint32_t        lost;
+    Stats           before;
+    Stats           during;
+} Fault;
+
+/* Host characteristics that bound the accuracy of the measurements:
+ * on embedded targets (e.g. ARMv7 without the architected timer) they
+ * can be in the same order of magnitude of the measured times */
+typedef struct {
+    char            clock_source[32];
+    /* L1 data cache line in bytes, -1 if unknown */
+    int64_t         cache_line;
+    /* CLOCK_MONOTONIC resolution, as declared by the kernel and as
+     * observed (smallest non-zero step between two reads), in nsec */
+    int64_t         clock_resolution;
+    int64_t         clock_step;
+    /* Cost of a CLOCK_MONOTONIC read through the C library (i.e. the
+     * vDSO, if supported) and through a system call, in nsec */
+    int64_t         clock_cost;
+    int64_t         syscall_cost;
+    /* Invariant TSC frequency in kHz (0 if not available) and cost */
+    int64_t         tsc_frequency;
+    int64_t         tsc_cost;
+    /* Whether get_monotonic_time() reads the TSC */
+    int             tsc;
+    /* Cost of get_monotonic_time(), subtracted from the measured times */
+    int64_t         read_cost;
+} Platform;
+
+/* Background capture of the EtherCAT frames on an interface */
+typedef struct {
+    FILE *          file;
+    int             fd;
+    pthread_t       thread;
+    int             running;
+    uint64_t        frames;
+} Capture;
+
+/* Live metrics of the current window, published in shared memory.
+ * They are protected by a sequence lock: `sequence` is odd while the
+ * loop is updating them, so readers must retry when it is odd or
+ * changed while reading. */
+typedef struct {
+    uint32_t        sequence;
+    pid_t           pid;
+    char            stack[16];
+    char            label[64];
+    long            period;
+    int             window;
+    int64_t         last;
+    uint32_t        errors;
+    uint32_t        wkc_errors;
+    uint64_t        overruns;
+    uint64_t        missed_slots;
+    Stats           stats;
+} Metrics;
+
+/* Everything needed to emit a result record */
+typedef struct {
+    const char *    stack;
+    const char *    label;
+    const char *    interference;
+    /* In usec, as given by the user: all the times are in nsec */
+    long            period;
+    int             window;
+    int64_t         start_time;
+    int             nphases;
+    Phase           phases[REPORT_MAX_PHASES];
+    Stats           stats;
+    Scheduler       scheduler;
+    uint32_t        errors;
+    uint32_t        wkc_errors;
+    NicSettings     nic;
+    Mailbox *       mailbox;
+    /* Memory usage at the beginning of the window and its increment */
+    MemoryUsage     memory_start;
+    MemoryUsage     memory;
+    Metrics *       metrics;
+    Reaction        reaction;
+    Platform        platform;
+    /* Links used by the stack (2 with redundancy) and iterations the
+     * stack reported to go through the redundant link */
+    int             links;
+    uint64_t        redundancy_active;
+    Fault           fault;
+} Report;
 
 
 int64_t         get_monotonic_time          (void);
-void            wait_next_iteration         (int64_t iteration_time,
-                                             int64_t period);
+void            scheduler_initialize        (Scheduler *scheduler,
+                                             int64_t period,
+                                             OverrunPolicy policy);
+void            scheduler_wait              (Scheduler *scheduler,
+                                             int64_t iteration_time);
+void            reaction_sent               (Reaction *reaction,
+                                             int64_t time,
+                                             int outputs);
+int             reaction_wait               (Reaction *reaction);
+void            reaction_received           (Reaction *reaction,
+                                             int64_t time,
+                                             int ok);
 const char *    get_default_interface       (void);
+int64_t         get_cache_line              (void);
+int             platform_check              (Platform *platform,
+                                             int use_tsc);
+void            platform_dump               (const Platform *platform);
+int             memcheck_prepare            (void);
+void            memcheck_count_allocation   (void);
+void            memcheck_sample             (MemoryUsage *usage);
+void            options_initialize          (Options *options);
+int             options_parse               (Options *options,
+                                             int argc,
+                                             char *argv[],
+                                             int *n);
+void            options_usage               (void);
+int             options_get_windows         (const Options *options);
+uint64_t        options_get_iterations      (const Options *options,
+                                             long period);
+int             sched_apply                 (const SchedSpec *spec);
+int             nic_get_settings            (NicSettings *settings,
+                                             const char *iface);
+int             nic_apply_profile           (const char *iface,
+                                             const char *profile);
+int             nic_setup                   (NicSettings *settings,
+                                             const char *iface,
+                                             const Options *options);
+void            nic_dump                    (const NicSettings *settings);
+int             mailbox_start               (Mailbox *mailbox,
+                                             MailboxCallback callback,
+                                             void *data,
+                                             const Options *options);
+void            mailbox_halt                (Mailbox *mailbox);
+int             mailbox_is_busy             (Mailbox *mailbox);
+void            mailbox_stop                (Mailbox *mailbox);
+Metrics *       metrics_open                (const char *name,
+                                             int writable);
+int             metrics_read                (const Metrics *metrics,
+                                             Metrics *snapshot);
+int             capture_start               (Capture *capture,
+                                             const char *iface,
+                                             const char *path);
+void            capture_stop                (Capture *capture);
+int             pcapng_write_header         (FILE *file,
+                                             const char *iface);
+int             pcapng_write_packet         (FILE *file,
+                                             uint64_t timestamp,
+                                             const void *data,
+                                             size_t size,
+                                             int outbound);
+void            stats_reset                 (Stats *stats);
+void            stats_add                   (Stats *stats,
+                                             int64_t value);
+int64_t         stats_percentile            (const Stats *stats,
+                                             double percentile);
+int             report_initialize           (Report *report,
+                                             const char *stack,
+                                             const Options *options);
+void            report_phase                (Report *report,
+                                             const char *name);
+void            report_add                  (Report *report,
+                                             int64_t time);
+void            report_dump                 (const Report *report);
+int             report_begin_window         (Report *report,
+                                             const Options *options,
+                                             int window);
+int             report_end_window           (Report *report,
+                                             const Options *options);
+int             report_write                (const Report *report,
+                                             const char *path);